@@ -65,6 +65,26 @@ static inline void aligned_memcpy(void* dst, void* src, size_t sz)
     }
 }
 
+static inline void unaligned_memcpy(void* dst, const void* src, size_t sz)
+{
+    const uint8_t* source = (const uint8_t*) src;
+    uint8_t* destination = (uint8_t*) dst;
+    const uint8_t* end = (const uint8_t*) src + (sz & ~((size_t) 0x1F));
+    while (source < end)
+    {
+        _mm256_storeu_si256( (__m256i*) destination, _mm256_loadu_si256((const __m256i*) source) );
+        source += 32;
+        destination += 32;
+    }
+    end += (sz & 0x1F);
+    while (source < end)
+    {
+        *destination = *source;
+        source++;
+        destination++;
+    }
+}
+
 static inline void aligned_memset(void* dst, uint32_t elem, size_t sz)
 {
     uint8_t* start = (uint8_t*) dst;
@@ -88,6 +108,11 @@ static inline void aligned_memcpy(void* dst, void* src, size_t sz)
     memcpy(dst, src, sz);
 }
 
+static inline void unaligned_memcpy(void* dst, const void* src, size_t sz)
+{
+    memcpy(dst, src, sz);
+}
+
 static inline void aligned_memset(void* dst, uint32_t elem, size_t sz)
 {
     memset(dst, elem, sz);
@@ -34,7 +34,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 
+#include <cstdint>
+
+
 #if _MSC_VER
+#include <intrin.h>
 #define align_alloc( A, B ) _aligned_malloc( B, A )
 #define align_free( A ) _aligned_free( A )
 #else
@@ -43,4 +47,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 
+// Index of the lowest set bit, v must not be 0
+static inline uint32_t count_trailing_zeros( uint64_t v )
+{
+#if _MSC_VER
+    unsigned long idx;
+    _BitScanForward64( &idx, v );
+    return (uint32_t) idx;
+#else
+    return (uint32_t) __builtin_ctzll( v );
+#endif
+}
+
+
 #define MAX_CACHE_LINE_SIZE 128
@@ -34,6 +34,613 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <clocale>
+#include <atomic>
+#include <string>
+#include <thread>
+#if defined(__has_include)
+#if __has_include(<charconv>) && __cplusplus >= 201703L
+#include <charconv>
+#endif
+#endif
+
+
+#include "../turbojson.h"
+#include "../platform.h"
+#include "../turbojson_events.h"
+
+
+// Parses json in ctx, which takes over the buffer in place of the one of the previous document
+static void reparseJson( struct JsonContext* ctx, const char* json )
+{
+    size_t size = strlen( json );
+    size_t allocsize = size + (size/2) + 64;
+    uint8_t* buffer = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, allocsize );
+
+    memcpy( buffer, json, size );
+    if (ctx->jsonbuffer) align_free( ctx->jsonbuffer );
+    turbojson_parsebuffer( ctx, buffer, size, allocsize );
+}
+
+
+static struct JsonContext* parseJson( const char* json, uint32_t flags=0 )
+{
+    struct JsonContext* ctx = turbojson_allocateContext( flags );
+
+    reparseJson( ctx, json );
+
+    return ctx;
+}
+
+
+static bool outputEquals( struct JsonContext* ctx, const char* expected )
+{
+    size_t size = strlen( expected );
+    return ctx->jsonoutIdx == size && memcmp( ctx->jsonout, expected, size ) == 0;
+}
+
+
+static const char* test_document = "{ \"a\": 1, \"b\" : [1, -2.5, {\"c\": \"d\"}],\n\t\"e\": {}, \"f\": [ ] }";
+static const char* test_document_minified = "{\"a\":1,\"b\":[1,-2.5,{\"c\":\"d\"}],\"e\":{},\"f\":[]}";
+
+
+static int test_json_parse_1()
+{
+    struct JsonContext* ctx = parseJson( test_document );
+    int status = 0;
+
+    turbojson_stringify( ctx );
+    if (!outputEquals( ctx, test_document_minified )) status = -1;
+
+    turbojson_pretty( ctx, true, 2 );
+    if (!outputEquals( ctx, "{\n  \"a\" : 1,\n  \"b\" : [\n    1,\n    -2.5,\n    {\n      \"c\" : \"d\"\n    }\n  ],\n  \"e\" : {},\n  \"f\" : []\n}\n" )) status = -2;
+
+    turbojson_freeContext( ctx );
+
+    return status;
+}
+
+
+// A root array of rows nested 3 levels deep, whose pretty form is much larger than its source
+static char* deepDocument( int rows )
+{
+    char* json = (char*) malloc( rows*64 + 16 );
+    int n = sprintf( json, "[" );
+
+    for (int k=0; k<rows; k++) n += sprintf( json+n, "%s{\"id\":%d,\"v\":[1,2,3,4,5,6,7,8,9,0]}", k ? "," : "", k );
+    sprintf( json+n, "]" );
+
+    return json;
+}
+
+
+static int test_json_large_document()
+{
+    struct JsonContext* ctx = parseJson( test_document, TURBOJSON_LARGE_DOCUMENT );
+    int status = 0;
+
+    if (ctx->dom != nullptr || ctx->dom64 == nullptr) status = -1;
+
+    turbojson_stringify( ctx );
+    if (!outputEquals( ctx, test_document_minified )) status = -2;
+
+    // Asked for by the caller, the 64-bit tape stays for small documents
+    reparseJson( ctx, "[1,2]" );
+    turbojson_stringify( ctx );
+    if (ctx->dom64 == nullptr || !outputEquals( ctx, "[1,2]" )) status = -3;
+
+    // The 64-bit tape is sized once, a grown tape would be larger than 4 entries per input byte
+    char* deep = deepDocument( 2000 );
+    reparseJson( ctx, deep );
+    turbojson_stringify( ctx );
+    if (ctx->domSz > 4*strlen( deep ) + 8 || !outputEquals( ctx, deep )) status = -6;
+    free( deep );
+
+    turbojson_freeContext( ctx );
+
+    // Chosen by the parser, it is only used for inputs above compactMax
+    ctx = turbojson_allocateContext( 0 );
+    ctx->compactMax = 16;
+
+    reparseJson( ctx, test_document );
+    turbojson_stringify( ctx );
+    if (ctx->dom != nullptr || ctx->dom64 == nullptr || !outputEquals( ctx, test_document_minified )) status = -4;
+
+    reparseJson( ctx, "[1,2]" );
+    turbojson_stringify( ctx );
+    if (ctx->dom == nullptr || ctx->dom64 != nullptr || (ctx->flags & TURBOJSON_LARGE_DOCUMENT) || !outputEquals( ctx, "[1,2]" )) status = -5;
+
+    turbojson_freeContext( ctx );
+
+    return status;
+}
+
+
+static int test_json_pretty_deep()
+{
+    char* json = deepDocument( 2000 );
+    struct JsonContext* ctx = parseJson( json );
+    int status = 0;
+
+    turbojson_pretty( ctx, true, 2 );
+    if (ctx->jsonoutIdx > ctx->jsonoutMax || memcmp( ctx->jsonout, "[\n  {\n    \"id\" : 0,\n    \"v\" : [\n      1,\n", 41 ) != 0) status = -1;
+
+    // Reading the pretty form back gives the source again
+    struct JsonContext* back = parseJson( std::string( (const char*) ctx->jsonout, ctx->jsonoutIdx ).c_str() );
+    turbojson_stringify( back );
+    if (!outputEquals( back, json )) status = -2;
+
+    turbojson_freeContext( back );
+    turbojson_freeContext( ctx );
+    free( json );
+
+    return status;
+}
+
+
+static int test_json_hash()
+{
+    struct JsonContext* a = parseJson( "{\"a\":1,\"b\":[1,2],\"c\":\"A\"}" );
+    struct JsonContext* b = parseJson( "{ \"c\": \"\\u0041\", \"b\" : [1.0, 2e0], \"a\": 10e-1 }", TURBOJSON_LARGE_DOCUMENT );
+    struct JsonContext* c = parseJson( "{\"a\":1,\"b\":[2,1],\"c\":\"A\"}" );
+    uint64_t ha[2], hb[2], hc[2];
+    int status = 0;
+
+    turbojson_hash128( a, 0, ha );
+    turbojson_hash128( b, 0, hb );
+    turbojson_hash128( c, 0, hc );
+
+    if (ha[0] != hb[0] || ha[1] != hb[1]) status = -1;
+    if (ha[0] == hc[0] || ha[1] == hc[1]) status = -2;
+    if (turbojson_hash( a, 0 ) != ha[0]) status = -3;
+
+    turbojson_freeContext( a );
+    turbojson_freeContext( b );
+    turbojson_freeContext( c );
+
+    return status;
+}
+
+
+static int test_json_canonical()
+{
+    struct JsonContext* ctx = parseJson( "{\"b\":[1.50,1e21,0.0000001,-0,120e-1], \"a\":\"\\u00e9\\n\\/\", \"c\":{\"z\":1,\"y\":2}}" );
+    int status = 0;
+
+    turbojson_canonical( ctx );
+    if (!outputEquals( ctx, "{\"a\":\"\xc3\xa9\\n/\",\"b\":[1.5,1e+21,1e-7,0,12],\"c\":{\"y\":2,\"z\":1}}" )) status = -1;
+
+    turbojson_freeContext( ctx );
+
+    return status;
+}
+
+
+static int test_json_intern_keys()
+{
+    char json[16384];
+    int n = sprintf( json, "{\"events\":[" );
+    for (int k=0; k<300; k++) n += sprintf( json+n, "%s{\"id\":%d,\"name\":\"e%d\",\"k%d\":1}", k ? "," : "", k, k, k );
+    sprintf( json+n, "]}" );
+
+    struct JsonContext* ctx = parseJson( json, TURBOJSON_INTERN_KEYS );
+    struct JsonContext* ref = parseJson( json );
+    int status = 0;
+
+    turbojson_stringify( ctx );
+    if (!outputEquals( ctx, json )) status = -1;
+    if (ctx->keysIdx != 303) status = -2;
+    if (turbojson_hash( ctx, 0 ) != turbojson_hash( ref, 0 )) status = -3;
+
+    uint64_t events = turbojson_getMember( ctx, 0, "events", 6 );
+    uint64_t name = turbojson_keyId( ctx, "name", 4 );
+    uint64_t first = ctx->dom[ctx->dom[events+1]+1];
+    uint64_t value = turbojson_getMemberById( ctx, first, name );
+
+    if (events == TURBOJSON_NOT_FOUND || ctx->dom[events] != TURBOJSON_DOM_ARRAY) status = -4;
+    if (value == TURBOJSON_NOT_FOUND || memcmp( ctx->jsonbuffer + ctx->dom[value+1], "e0", 2 ) != 0) status = -5;
+    if (turbojson_keyId( ctx, "missing", 7 ) != TURBOJSON_NOT_FOUND) status = -6;
+    if (turbojson_getMember( ctx, first, "k1", 2 ) != TURBOJSON_NOT_FOUND) status = -7;
+
+    turbojson_freeContext( ctx );
+    turbojson_freeContext( ref );
+
+    return status;
+}
+
+
+static int test_json_columns()
+{
+    const char* json = "{\"rows\":[{\"id\":1,\"price\":2.5,\"name\":\"a\"},{\"name\":\"bc\",\"id\":-7,\"price\":\"x\"},"
+        "{\"id\":1.5},3,{\"price\":1e2,\"id\":12345678901234}]}";
+    uint32_t modes[3] = { 0, TURBOJSON_INTERN_KEYS, TURBOJSON_LARGE_DOCUMENT };
+    int status = 0;
+
+    for (uint32_t m=0; m<3; m++)
+    {
+        struct JsonContext* ctx = parseJson( json, modes[m] );
+        struct JsonColumn columns[3] = {};
+        const char* names[3] = { "id", "price", "name" };
+        uint32_t types[3] = { TURBOJSON_COLUMN_INT64, TURBOJSON_COLUMN_DOUBLE, TURBOJSON_COLUMN_STRING };
+
+        for (int c=0; c<3; c++)
+        {
+            columns[c].name = names[c];
+            columns[c].nameLen = strlen( names[c] );
+            columns[c].type = types[c];
+        }
+
+        if (!turbojson_to_columns( ctx, turbojson_getMember( ctx, 0, "rows", 4 ), columns, 3 )) status = -1;
+        else
+        {
+            int64_t* ids = (int64_t*) columns[0].values;
+            double* prices = (double*) columns[1].values;
+
+            if (columns[0].length != 5 || columns[0].nullCount != 2 || columns[0].validity[0] != 0x13) status = -2;
+            if (ids[0] != 1 || ids[1] != -7 || ids[2] != 0 || ids[4] != 12345678901234LL) status = -3;
+            if (columns[1].nullCount != 3 || columns[1].validity[0] != 0x11 || prices[0] != 2.5 || prices[4] != 100.0) status = -4;
+            if (columns[2].nullCount != 3 || columns[2].validity[0] != 0x03 || columns[2].stringLengths[1] != 2) status = -5;
+            if (memcmp( ctx->jsonbuffer + columns[2].stringOffsets[1], "bc", 2 ) != 0) status = -6;
+        }
+
+        turbojson_freeColumns( columns, 3 );
+        turbojson_freeContext( ctx );
+    }
+
+    return status;
+}
+
+
+static int test_json_splice()
+{
+    const char* json = "{\"a\": [1,2,{\"b\":\"c\"},\"a string longer than thirty two bytes\"], \"d\":{\"e\":[ ]}}";
+    struct JsonContext* ctx = parseJson( json );
+    uint64_t a = turbojson_getMember( ctx, 0, "a", 1 );
+    uint64_t d = turbojson_getMember( ctx, 0, "d", 1 );
+    int status = 0;
+
+    if (ctx->dom[2] != 0 || ctx->dom[3] & 0x80000000) status = -1;
+    if (!(ctx->dom[a+3] & 0x80000000) || (ctx->dom[a+3] & 0x7FFFFFFF) != 61 || ctx->dom[d+3] & 0x80000000) status = -2;
+
+    turbojson_stringify( ctx );
+    if (!outputEquals( ctx, "{\"a\":[1,2,{\"b\":\"c\"},\"a string longer than thirty two bytes\"],\"d\":{\"e\":[]}}" )) status = -3;
+
+    turbojson_freeContext( ctx );
+
+    return status;
+}
+
+
+static int test_json_validate()
+{
+    static const char* valid[] = {
+        "{\"a\": [1, -2.5e+3, 0, true, false, null], \"b\": {\"c\": \"d\\n\\u00e9\"}, \"e\": [], \"f\": {}}",
+        " \"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80 a string longer than thirty two bytes\" ",
+        "-0.5"
+    };
+    static const struct { const char* json; uint64_t errpos; } invalid[] = {
+        { "{\"a\": 01}", 7 },
+        { "[1, 2,]", 6 },
+        { "{\"a\" 1}", 5 },
+        { "[tru]", 4 },
+        { "[1] 2", 4 },
+        { "{\"a\": [1, 2}", 11 },
+        { "\"\\x\"", 2 },
+        { "\"abc", 4 },
+        { "", 0 },
+        { "[\"0123456789012345678901234567890123456789\xc0\x80\"]", 42 },
+        { "[\"0123456789012345678901234567890123456789\xed\xa0\x80\"]", 42 },
+        { "\"\t\"", 1 }
+    };
+    int status = 0;
+    uint64_t errpos;
+
+    for (uint32_t k=0; k<sizeof(valid)/sizeof(valid[0]); k++)
+        if (!turbojson_validate( (const uint8_t*) valid[k], strlen( valid[k] ), &errpos )) status = -1;
+
+    for (uint32_t k=0; k<sizeof(invalid)/sizeof(invalid[0]); k++)
+    {
+        errpos = 0xFFFF;
+        if (turbojson_validate( (const uint8_t*) invalid[k].json, strlen( invalid[k].json ), &errpos )) status = -2;
+        else if (errpos != invalid[k].errpos) status = -3;
+    }
+
+    // Numbers, strings and escapes cut by the 64 byte blocks
+    char json[160];
+    memset( json, '1', sizeof(json) );
+    json[0] = '[';
+    strcpy( json+70, "x]" );
+    if (turbojson_validate( (const uint8_t*) json, strlen( json ), &errpos ) || errpos != 70) status = -5;
+
+    memset( json, 'a', sizeof(json) );
+    json[0] = '"';
+    strcpy( json+63, "\\\\\\\"\"" );
+    if (!turbojson_validate( (const uint8_t*) json, strlen( json ), &errpos )) status = -6;
+    strcpy( json+63, "\\\\\\q\"" );
+    if (turbojson_validate( (const uint8_t*) json, strlen( json ), &errpos ) || errpos != 66) status = -7;
+
+    memset( json, ' ', sizeof(json) );
+    json[63] = '[';
+    json[64] = '"';
+    strcpy( json+150, "\"]" );
+    if (!turbojson_validate( (const uint8_t*) json, strlen( json ), &errpos )) status = -8;
+    json[100] = '\n';
+    if (turbojson_validate( (const uint8_t*) json, strlen( json ), &errpos ) || errpos != 100) status = -9;
+
+    // Literals are now kept on the tape
+    struct JsonContext* ctx = parseJson( "{\"a\": [true, {\"b\": null}, false]}" );
+    turbojson_stringify( ctx );
+    if (!outputEquals( ctx, "{\"a\":[true,{\"b\":null},false]}" )) status = -4;
+    turbojson_freeContext( ctx );
+
+    return status;
+}
+
+
+static int test_json_document_swap()
+{
+    char json[64];
+    sprintf( json, "{\"version\":%d}", 0 );
+    struct JsonDocumentSlot* slot = turbojson_allocateSlot( turbojson_freeze( parseJson( json ) ) );
+    std::atomic<bool> done( false );
+    std::atomic<int> status( 0 );
+    std::thread readers[4];
+
+    for (int t=0; t<4; t++)
+    {
+        readers[t] = std::thread( [&]() {
+            int last = 0;
+            while (!done.load())
+            {
+                struct JsonDocument* doc = turbojson_acquire( slot );
+                const struct JsonContext* ctx = turbojson_documentContext( doc );
+                uint64_t v = turbojson_getMember( ctx, 0, "version", 7 );
+                int version = v == TURBOJSON_NOT_FOUND ? -1 : atoi( (const char*) ctx->jsonbuffer + ctx->dom[v+1] );
+
+                // Versions are published in order
+                if (version < last) status = -1;
+                last = version;
+                turbojson_release( doc );
+            }
+        } );
+    }
+
+    for (int k=1; k<=2000; k++)
+    {
+        sprintf( json, "{\"version\":%d}", k );
+        turbojson_publish( slot, turbojson_freeze( parseJson( json ) ) );
+    }
+
+    done = true;
+    for (int t=0; t<4; t++) readers[t].join();
+
+    struct JsonDocument* doc = turbojson_acquire( slot );
+    const struct JsonContext* ctx = turbojson_documentContext( doc );
+    if (memcmp( ctx->jsonbuffer + ctx->dom[turbojson_getMember( ctx, 0, "version", 7 )+1], "2000", 4 ) != 0) status = -2;
+
+    // The document outlives the slot while a reference is held
+    turbojson_freeSlot( slot );
+    if (turbojson_getMember( ctx, 0, "version", 7 ) == TURBOJSON_NOT_FOUND) status = -3;
+    turbojson_release( doc );
+
+    return status;
+}
+
+
+// Rebuilds the minified document from the events
+struct EventPrinter {
+    char out[256];
+    int n = 0;
+    bool comma = false;
+
+    void text( const char* s, const uint8_t* start, uint64_t len, const char* after )
+    {
+        n += sprintf( out+n, "%s%s%.*s%s", comma ? "," : "", s, (int) len, (const char*) start, after );
+    }
+    void startObject() { text( "{", (const uint8_t*) "", 0, "" ); comma = false; }
+    void endObject() { n += sprintf( out+n, "}" ); comma = true; }
+    void startArray() { text( "[", (const uint8_t*) "", 0, "" ); comma = false; }
+    void endArray() { n += sprintf( out+n, "]" ); comma = true; }
+    void key( const uint8_t* start, uint64_t len ) { text( "\"", start, len, "\":" ); comma = false; }
+    void string( const uint8_t* start, uint64_t len ) { text( "\"", start, len, "\"" ); comma = true; }
+    void number( const uint8_t* start, uint64_t len ) { text( "", start, len, "" ); comma = true; }
+    void literal( const uint8_t* start, uint64_t len ) { text( "", start, len, "" ); comma = true; }
+};
+
+
+static void sumNumber( void* userdata, const uint8_t* start, uint64_t len )
+{
+    *(double*) userdata += strtod( std::string( (const char*) start, len ).c_str(), nullptr );
+}
+
+
+static int test_json_events()
+{
+    const char* json = "{ \"a\": [1, -2.5, true, null], \"b\" : {\"c\": \"d\\\"\"}, \"e\": {}, \"f\": [ ] }";
+    EventPrinter printer;
+    struct JsonEventHandlers handlers = {};
+    double sum = 0;
+    int status = 0;
+
+    turbojson_parse_events( (const uint8_t*) json, strlen( json ), printer );
+    if (strcmp( printer.out, "{\"a\":[1,-2.5,true,null],\"b\":{\"c\":\"d\\\"\"},\"e\":{},\"f\":[]}" ) != 0) status = -1;
+
+    handlers.number = sumNumber;
+    turbojson_parse_events( (const uint8_t*) json, strlen( json ), &handlers, &sum );
+    if (sum != -1.5) status = -2;
+
+    return status;
+}
+
+
+static int test_json_parallel()
+{
+    static char json[65536];
+    int status = 0;
+
+    for (int root=0; root<2; root++)
+    {
+        int n = sprintf( json, root ? "{" : "[" );
+        for (int k=0; k<500; k++)
+        {
+            if (root) n += sprintf( json+n, "%s\"k%d\": ", k ? ", " : "", k );
+            else n += sprintf( json+n, "%s", k ? ", " : "" );
+            n += sprintf( json+n, k % 3 ? "{\"id\":%d,\"tags\":[\"a\",\"b\"],\"x\":{}}" : "[%d, {\"y\": [ ]}, \"s\"]", k );
+        }
+        sprintf( json+n, root ? "}" : "]" );
+
+        uint32_t modes[2] = { 0, TURBOJSON_LARGE_DOCUMENT | TURBOJSON_INTERN_KEYS };
+
+        for (uint32_t m=0; m<2; m++)
+        {
+            struct JsonContext* ctx = parseJson( json, modes[m] );
+            uint64_t size;
+            char* serial;
+
+            turbojson_pretty( ctx, true, 2 );
+            size = ctx->jsonoutIdx;
+            serial = (char*) malloc( size );
+            memcpy( serial, ctx->jsonout, size );
+
+            turbojson_pretty_parallel( ctx, true, 2, true, 4 );
+            if (ctx->jsonoutIdx != size || memcmp( ctx->jsonout, serial, size ) != 0) status = -1;
+            free( serial );
+
+            turbojson_stringify( ctx );
+            size = ctx->jsonoutIdx;
+            serial = (char*) malloc( size );
+            memcpy( serial, ctx->jsonout, size );
+
+            turbojson_stringify_parallel( ctx, 3 );
+            if (ctx->jsonoutIdx != size || memcmp( ctx->jsonout, serial, size ) != 0) status = -2;
+            free( serial );
+
+            turbojson_freeContext( ctx );
+        }
+    }
+
+    // Rows three levels deep, the indentation makes the output much larger than the source
+    char* deep = deepDocument( 40000 );
+    struct JsonContext* ctx = parseJson( deep, 0 );
+    uint64_t size;
+    char* serial;
+
+    turbojson_pretty( ctx, true, 2 );
+    size = ctx->jsonoutIdx;
+    serial = (char*) malloc( size );
+    memcpy( serial, ctx->jsonout, size );
+
+    turbojson_pretty_parallel( ctx, true, 2, true, 4 );
+    if (ctx->jsonoutIdx != size || memcmp( ctx->jsonout, serial, size ) != 0) status = -3;
+
+    free( serial );
+    turbojson_freeContext( ctx );
+    free( deep );
+
+    return status;
+}
+
+
+static int test_json_binary()
+{
+    const char* json = "{\"a\": [1, -2, 300, -200, 1.5, \"\\u00e9\", true, null], \"b\": {}}";
+    const char* minified = "{\"a\":[1,-2,300,-200,1.5,\"\xc3\xa9\",true,null],\"b\":{}}";
+    static const uint8_t msgpack[] = { 0x82, 0xA1, 'a', 0x98, 0x01, 0xFE, 0xCD, 0x01, 0x2C, 0xD1, 0xFF, 0x38,
+        0xCB, 0x3F, 0xF8, 0, 0, 0, 0, 0, 0, 0xA2, 0xC3, 0xA9, 0xC3, 0xC0, 0xA1, 'b', 0x80 };
+    static const uint8_t cbor[] = { 0xA2, 0x61, 'a', 0x88, 0x01, 0x21, 0x19, 0x01, 0x2C, 0x38, 0xC7,
+        0xFB, 0x3F, 0xF8, 0, 0, 0, 0, 0, 0, 0x62, 0xC3, 0xA9, 0xF5, 0xF6, 0x61, 'b', 0xA0 };
+    uint32_t modes[2] = { 0, TURBOJSON_LARGE_DOCUMENT | TURBOJSON_INTERN_KEYS };
+    int status = 0;
+
+    for (uint32_t m=0; m<2; m++)
+    {
+        struct JsonContext* ctx = parseJson( json, modes[m] );
+        struct JsonContext* back = turbojson_allocateContext( modes[m] );
+
+        turbojson_to_msgpack( ctx );
+        if (ctx->jsonoutIdx != sizeof(msgpack) || memcmp( ctx->jsonout, msgpack, sizeof(msgpack) ) != 0) status = -1;
+
+        turbojson_to_cbor( ctx );
+        if (ctx->jsonoutIdx != sizeof(cbor) || memcmp( ctx->jsonout, cbor, sizeof(cbor) ) != 0) status = -2;
+
+        turbojson_from_msgpack( back, msgpack, sizeof(msgpack) );
+        turbojson_stringify( back );
+        if (!outputEquals( back, minified )) status = -3;
+        if (turbojson_hash( back, 0 ) != turbojson_hash( ctx, 0 )) status = -4;
+
+        turbojson_to_msgpack( back );
+        if (back->jsonoutIdx != sizeof(msgpack) || memcmp( back->jsonout, msgpack, sizeof(msgpack) ) != 0) status = -5;
+
+        turbojson_from_cbor( back, cbor, sizeof(cbor) );
+        turbojson_pretty( back, true, 2 );
+        if (!outputEquals( back, "{\n  \"a\" : [\n    1,\n    -2,\n    300,\n    -200,\n    1.5,\n    \"\xc3\xa9\",\n    true,\n    null\n  ],\n  \"b\" : {}\n}\n" )) status = -6;
+
+        // Truncated input
+        turbojson_from_cbor( back, cbor, sizeof(cbor)-1 );
+        if (back->domIdx != 0) status = -7;
+
+        // Doubles are printed with the fewest digits that read back exactly, 15 to 17 without <charconv>
+        static const uint8_t doubles[] = { 0x93, 0xCB, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xCB, 0x3F, 0xB9, 0x99, 0x99, 0x99, 0x99, 0x99, 0x9A,
+            0xCB, 0x43, 0x30, 0, 0, 0, 0, 0, 0 };
+        turbojson_from_msgpack( back, doubles, sizeof(doubles) );
+        turbojson_stringify( back );
+#if defined(__cpp_lib_to_chars)
+        if (!outputEquals( back, "[5e-324,0.1,4503599627370496.0]" )) status = -11;
+#else
+        if (!outputEquals( back, "[4.94065645841247e-324,0.1,4503599627370496.0]" )) status = -11;
+#endif
+
+        // Nesting is limited to 1024 levels in both directions
+        static uint8_t nested[2*1024*1024];
+        memset( nested, 0x91, sizeof(nested) );
+        nested[sizeof(nested)-1] = 0xC0;
+        turbojson_from_msgpack( back, nested, sizeof(nested) );
+        if (back->domIdx != 0) status = -8;
+
+        turbojson_from_msgpack( back, nested + sizeof(nested)-1025, 1025 );
+        turbojson_to_msgpack( back );
+        if (back->jsonoutIdx != 1025 || memcmp( back->jsonout, nested + sizeof(nested)-1025, 1025 ) != 0) status = -9;
+
+        std::string deep = std::string( 1025, '[' ) + std::string( 1025, ']' );
+        turbojson_freeContext( ctx );
+        ctx = parseJson( deep.c_str(), modes[m] );
+        turbojson_to_cbor( ctx );
+        if (ctx->domIdx == 0 || ctx->jsonoutIdx != 0) status = -10;
+
+        turbojson_freeContext( ctx );
+        turbojson_freeContext( back );
+    }
+
+    return status;
+}
+
+
+// Numbers must not follow LC_NUMERIC, nothing is checked when no comma decimal locale is installed
+static int test_json_locale()
+{
+    const char* names[4] = { "de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8" };
+    int status = 0;
+    int k = 0;
+
+    while (k < 4 && setlocale( LC_NUMERIC, names[k] ) == nullptr) k++;
+    if (k == 4) return 0;
+
+    // More than 19 digits go through the slow path of the number parser
+    struct JsonContext* ctx = parseJson( "[1.5,0.30000000000000000000001,-2]" );
+    struct JsonContext* back = turbojson_allocateContext( 0 );
+
+    turbojson_to_msgpack( ctx );
+    turbojson_from_msgpack( back, ctx->jsonout, ctx->jsonoutIdx );
+    turbojson_stringify( back );
+    if (!outputEquals( back, "[1.5,0.3,-2]" )) status = -1;
+
+    turbojson_freeContext( ctx );
+    turbojson_freeContext( back );
+
+    setlocale( LC_NUMERIC, "C" );
+
+    return status;
+}
 
 
 int main( int argc, const char** argv )
@@ -42,18 +649,34 @@ int main( int argc, const char** argv )
 
     if (argc != 2) return -2;
 
-    /*
-    if (strcmp(argv[1], "test_lzaahe_context") == 0)
-        status = test_lzaahe_context();
-    else if (strcmp(argv[1], "test_lzaahe_sort") == 0)
-        status = test_lzaahe_sort();
-    else if (strcmp(argv[1], "test_arith32") == 0)
-        status = test_arith32();
-    else if (strcmp(argv[1], "test_arith64") == 0)
-        status = test_arith64();
-    else if (strcmp(argv[1], "test_bitio") == 0)
-        status = test_lzaahe_bitio();
-    */
+    if (strcmp(argv[1], "test_json_parse_1") == 0)
+        status = test_json_parse_1();
+    else if (strcmp(argv[1], "test_json_large_document") == 0)
+        status = test_json_large_document();
+    else if (strcmp(argv[1], "test_json_pretty_deep") == 0)
+        status = test_json_pretty_deep();
+    else if (strcmp(argv[1], "test_json_hash") == 0)
+        status = test_json_hash();
+    else if (strcmp(argv[1], "test_json_canonical") == 0)
+        status = test_json_canonical();
+    else if (strcmp(argv[1], "test_json_intern_keys") == 0)
+        status = test_json_intern_keys();
+    else if (strcmp(argv[1], "test_json_columns") == 0)
+        status = test_json_columns();
+    else if (strcmp(argv[1], "test_json_splice") == 0)
+        status = test_json_splice();
+    else if (strcmp(argv[1], "test_json_validate") == 0)
+        status = test_json_validate();
+    else if (strcmp(argv[1], "test_json_document_swap") == 0)
+        status = test_json_document_swap();
+    else if (strcmp(argv[1], "test_json_events") == 0)
+        status = test_json_events();
+    else if (strcmp(argv[1], "test_json_parallel") == 0)
+        status = test_json_parallel();
+    else if (strcmp(argv[1], "test_json_binary") == 0)
+        status = test_json_binary();
+    else if (strcmp(argv[1], "test_json_locale") == 0)
+        status = test_json_locale();
 
     return status;
 }
@@ -36,13 +36,28 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <cmath>
+#include <clocale>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#if defined(__has_include)
+#if __has_include(<charconv>) && __cplusplus >= 201703L
+#include <charconv>
+#endif
+#endif
 
 
 #include "turbojson.h"
 #include "platform.h"
+#include "aligned_string.h"
+#include "turbojson_events.h"
 
 
-extern "C" struct JsonContext* turbojson_allocateContext()
+extern "C" struct JsonContext* turbojson_allocateContext( uint32_t flags )
 {
     struct JsonContext* context;
 
@@ -54,6 +69,7 @@ extern "C" struct JsonContext* turbojson_allocateContext()
         context->jsonbufferSize = 0;
         context->jsonbufferMax = 0;
         context->dom = nullptr;
+        context->dom64 = nullptr;
         context->domIdx = 0;
         context->domSz = 0;
         context->values = nullptr;
@@ -62,6 +78,13 @@ extern "C" struct JsonContext* turbojson_allocateContext()
         context->jsonout = nullptr;
         context->jsonoutIdx = 0;
         context->jsonoutMax = 0;
+        context->keys = nullptr;
+        context->keysIdx = 0;
+        context->keysSz = 0;
+        context->keysTable = nullptr;
+        context->keysTableSz = 0;
+        context->flags = flags;
+        context->compactMax = TURBOJSON_COMPACT_MAX;
     }
 
     return context;
@@ -72,434 +95,3741 @@ extern "C" void turbojson_freeContext( struct JsonContext* ctx )
 {
     if (ctx->jsonbuffer) align_free(ctx->jsonbuffer);
     if (ctx->dom) align_free(ctx->dom);
+    if (ctx->dom64) align_free(ctx->dom64);
     if (ctx->values) align_free(ctx->values);
     if (ctx->jsonout) align_free(ctx->jsonout);
+    if (ctx->keys) align_free(ctx->keys);
+    if (ctx->keysTable) align_free(ctx->keysTable);
     align_free(ctx);
 }
 
 
-#define TURBOJSON_DOM_OBJECT 1
-#define TURBOJSON_DOM_STRING 2
-#define TURBOJSON_DOM_REAL 3
-#define TURBOJSON_DOM_ARRAY 4
-#define TURBOJSON_DOM_MEMBER 5
-#define TURBOJSON_DOM_ARRAY_ELEMENT 6
+/*
+Frozen documents. A slot holds the current document and a count of the readers that are
+between loading the slot and taking their own reference, packed in the 16 bits above the 48
+bit document address. Publishing swaps the word and moves that count to the reference count of the
+replaced document, so a reader never touches a document that may be freed.
+*/
+
+// The high 16 bits of a slot count the readers in the middle of an acquire, user space addresses fit in the low 48
+#define TURBOJSON_DOCUMENT_POINTER 0x0000FFFFFFFFFFFFULL
+#define TURBOJSON_DOCUMENT_READER (TURBOJSON_DOCUMENT_POINTER+1)
+
+
+struct JsonDocument {
+    std::atomic<uint64_t> refs;
+    struct JsonContext* ctx;
+};
+
+
+struct JsonDocumentSlot {
+    std::atomic<uint64_t> word;
+};
+
+
+static inline struct JsonDocument* slotDocument( uint64_t word )
+{
+    return (struct JsonDocument*) (uintptr_t) (word & TURBOJSON_DOCUMENT_POINTER);
+}
+
+
+static inline uint64_t slotReaders( uint64_t word )
+{
+    return word / TURBOJSON_DOCUMENT_READER;
+}
+
+
+extern "C" struct JsonDocument* turbojson_freeze( struct JsonContext* ctx )
+{
+    struct JsonDocument* doc = (struct JsonDocument*) align_alloc( MAX_CACHE_LINE_SIZE, MAX_CACHE_LINE_SIZE );
+
+    // A slot cannot hold an address above 48 bits
+    if (doc != nullptr && ((uint64_t) (uintptr_t) doc & ~TURBOJSON_DOCUMENT_POINTER) != 0)
+    {
+        align_free( doc );
+        doc = nullptr;
+    }
+
+    if (doc != nullptr)
+    {
+        new (&doc->refs) std::atomic<uint64_t>( 1 );
+        doc->ctx = ctx;
+
+        // The output buffer is of no use to a read-only document
+        if (ctx->jsonout) align_free(ctx->jsonout);
+        ctx->jsonout = nullptr;
+        ctx->jsonoutIdx = 0;
+        ctx->jsonoutMax = 0;
+    }
+
+    return doc;
+}
+
+
+extern "C" const struct JsonContext* turbojson_documentContext( const struct JsonDocument* doc )
+{
+    return doc->ctx;
+}
+
+
+extern "C" void turbojson_retain( struct JsonDocument* doc )
+{
+    doc->refs.fetch_add( 1, std::memory_order_relaxed );
+}
+
+
+extern "C" void turbojson_release( struct JsonDocument* doc )
+{
+    if (doc->refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1)
+    {
+        turbojson_freeContext( doc->ctx );
+        align_free( doc );
+    }
+}
+
+
+extern "C" struct JsonDocumentSlot* turbojson_allocateSlot( struct JsonDocument* doc )
+{
+    struct JsonDocumentSlot* slot = (struct JsonDocumentSlot*) align_alloc( MAX_CACHE_LINE_SIZE, MAX_CACHE_LINE_SIZE );
+
+    if (slot != nullptr)
+        new (&slot->word) std::atomic<uint64_t>( (uint64_t) (uintptr_t) doc );
+
+    return slot;
+}
+
+
+extern "C" void turbojson_freeSlot( struct JsonDocumentSlot* slot )
+{
+    struct JsonDocument* doc = slotDocument( slot->word.load( std::memory_order_acquire ) );
+
+    if (doc) turbojson_release( doc );
+    align_free( slot );
+}
+
+
+extern "C" struct JsonDocument* turbojson_acquire( struct JsonDocumentSlot* slot )
+{
+    uint64_t word = slot->word.load( std::memory_order_relaxed );
+
+    // The reader count keeps the document alive until we hold our own reference, a full count waits for a reader to leave
+    for (;;)
+    {
+        if (slotDocument( word ) == nullptr) return nullptr;
+
+        if (slotReaders( word ) == 0xFFFF)
+        {
+            std::this_thread::yield();
+            word = slot->word.load( std::memory_order_relaxed );
+        }
+        else if (slot->word.compare_exchange_weak( word, word + TURBOJSON_DOCUMENT_READER, std::memory_order_acquire, std::memory_order_relaxed ))
+            break;
+    }
+
+    word += TURBOJSON_DOCUMENT_READER;
+
+    struct JsonDocument* doc = slotDocument( word );
+
+    doc->refs.fetch_add( 1, std::memory_order_relaxed );
+
+    // Give back the reader count, or the reference it became if the document was replaced
+    while (slotDocument( word ) == doc && slotReaders( word ) != 0)
+    {
+        if (slot->word.compare_exchange_weak( word, word - TURBOJSON_DOCUMENT_READER, std::memory_order_release, std::memory_order_relaxed ))
+            return doc;
+    }
+
+    doc->refs.fetch_sub( 1, std::memory_order_relaxed );
+
+    return doc;
+}
+
+
+extern "C" void turbojson_publish( struct JsonDocumentSlot* slot, struct JsonDocument* doc )
+{
+    uint64_t old = slot->word.exchange( (uint64_t) (uintptr_t) doc, std::memory_order_acq_rel );
+    struct JsonDocument* oldDoc = slotDocument( old );
+
+    if (oldDoc)
+    {
+        oldDoc->refs.fetch_add( slotReaders( old ), std::memory_order_relaxed );
+        turbojson_release( oldDoc );
+    }
+}
+
+
+// Set with TURBOJSON_LARGE_DOCUMENT when the parser rather than the caller chose the 64-bit tape
+#define TURBOJSON_LARGE_AUTOMATIC 0x80000000
+
+
+// Picks the tape of a document whose offsets go up to size, the 64-bit one stays when the caller asked for it
+static void selectTape( struct JsonContext* ctx, uint64_t size )
+{
+    uint64_t compactMax = ctx->compactMax < TURBOJSON_COMPACT_MAX ? ctx->compactMax : TURBOJSON_COMPACT_MAX;
+
+    if (ctx->flags & TURBOJSON_LARGE_AUTOMATIC) ctx->flags &= ~(TURBOJSON_LARGE_DOCUMENT | TURBOJSON_LARGE_AUTOMATIC);
+
+    if (!(ctx->flags & TURBOJSON_LARGE_DOCUMENT) && size > compactMax) ctx->flags |= TURBOJSON_LARGE_DOCUMENT | TURBOJSON_LARGE_AUTOMATIC;
+}
+
+
+#define turbojson_memcpy8( A, B ) *((uint64_t*) (A)) = *((const uint64_t*) (B))
+
+
+static void turbojson_memcpy( uint8_t* dst, const uint8_t* src, const uint8_t* srcend )
+{
+    do {
+        turbojson_memcpy8( dst, src );
+        src += 8;
+        dst += 8;
+    } while (src < srcend) ;
+}
+
+
+/*
+The tape being written by the parser. T is uint32_t for the compact tape and uint64_t for
+large documents, both the tape indices and the jsonbuffer offsets stored in it are of type T.
+It is the sink of the grammar of turbojson_events.h, the methods are defined after internKey.
+*/
+template <typename T>
+struct JsonTape {
+    typedef T Index;
+
+    T* dom;
+    T domIdx;
+    T domSz;
+    bool overflow;
+    T spaces; // Number of whitespace bytes skipped so far
+    struct JsonContext* keys; // The context holding the key dictionary when interning keys, nullptr otherwise
+
+    bool reserve( T n );
+    void skipped( T n ) { spaces += n; }
+    T spacesSkipped() const { return spaces; }
+    T scalar( const uint8_t* buffer, uint32_t type, T start, T end );
+    T beginContainer( uint32_t type, T start );
+    void endContainer( T idx, uint32_t type, T end, bool minified );
+    T member( const uint8_t* buffer, T keyStart, T keyEnd );
+    void memberValue( T m, T v ) { dom[m + (keys ? 2 : 3)] = v; }
+    T element();
+    void elementValue( T e, T v ) { dom[e+1] = v; }
+    void link( T container, T prev, T item, uint32_t type );
+};
+
+
+template <typename T>
+static bool reserveTape( JsonTape<T>& tape, T n )
+{
+    if (tape.domIdx + n <= tape.domSz) return true;
+    if (tape.overflow) return false;
+
+    uint64_t newSz = 2 * (uint64_t) tape.domSz + n;
+    if (newSz > (uint64_t) TURBOJSON_NIL(T)) newSz = TURBOJSON_NIL(T);
+
+    T* dom = nullptr;
+    if (tape.domIdx + (uint64_t) n <= newSz) dom = (T*) align_alloc( MAX_CACHE_LINE_SIZE, newSz*sizeof(T) );
+
+    if (dom == nullptr)
+    {
+        tape.overflow = true;
+        return false;
+    }
+
+    memcpy( dom, tape.dom, tape.domIdx*sizeof(T) );
+    align_free( tape.dom );
+
+    tape.dom = dom;
+    tape.domSz = (T) newSz;
+
+    return true;
+}
+
+
+/*
+Key dictionary. keys holds the start and end offsets in jsonbuffer of the first occurrence of
+each key, keysTable is an open addressing hash table whose entries are the key hash in the
+upper 32 bits and the key id + 1 in the lower 32 bits, 0 for an empty slot.
+*/
+static inline uint32_t keyHash( const uint8_t* key, uint64_t len )
+{
+    uint64_t h = len;
+    uint64_t w;
+
+#ifdef AVX2
+    while (len >= 8)
+    {
+        memcpy( &w, key, 8 );
+        h = _mm_crc32_u64( h, w );
+        key += 8;
+        len -= 8;
+    }
+    w = 0;
+    memcpy( &w, key, len );
+    h = _mm_crc32_u64( h, w );
+    return (uint32_t) h;
+#else
+    while (len >= 8)
+    {
+        memcpy( &w, key, 8 );
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+        key += 8;
+        len -= 8;
+    }
+    w = 0;
+    memcpy( &w, key, len );
+    h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (h >> 32);
+#endif
+}
+
+
+static inline uint64_t* findKey( const struct JsonContext* ctx, const uint8_t* key, uint64_t len, uint32_t hash )
+{
+    uint32_t mask = ctx->keysTableSz - 1;
+    uint32_t slot = hash & mask;
+
+    for (;;)
+    {
+        uint64_t* entry = &ctx->keysTable[slot];
+
+        if (*entry == 0) return entry;
+
+        if ((uint32_t) (*entry >> 32) == hash)
+        {
+            uint32_t id = (uint32_t) *entry - 1;
+            uint64_t start = ctx->keys[2*id];
+            if (ctx->keys[2*id+1] - start == len && memcmp( ctx->jsonbuffer + start, key, len ) == 0) return entry;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+
+static bool growKeyTable( struct JsonContext* ctx )
+{
+    uint32_t newSz = ctx->keysTableSz ? 2*ctx->keysTableSz : 256;
+    uint64_t* table = (uint64_t*) align_alloc( MAX_CACHE_LINE_SIZE, newSz*sizeof(uint64_t) );
+
+    if (table == nullptr) return false;
+
+    memset( table, 0, newSz*sizeof(uint64_t) );
+
+    if (ctx->keysTable) align_free( ctx->keysTable );
+
+    ctx->keysTable = table;
+    ctx->keysTableSz = newSz;
+
+    for (uint32_t id=0; id<ctx->keysIdx; id++)
+    {
+        uint64_t start = ctx->keys[2*id];
+        uint64_t len = ctx->keys[2*id+1] - start;
+        uint32_t hash = keyHash( ctx->jsonbuffer + start, len );
+        *findKey( ctx, ctx->jsonbuffer + start, len, hash ) = ((uint64_t) hash << 32) | (id + 1);
+    }
+
+    return true;
+}
+
+
+// Returns the id of the key [start, end) of jsonbuffer, adding it to the dictionary if needed, 0xFFFFFFFF when out of memory
+static uint32_t internKey( struct JsonContext* ctx, uint64_t start, uint64_t end )
+{
+    const uint8_t* key = ctx->jsonbuffer + start;
+    uint32_t hash = keyHash( key, end-start );
+    uint64_t* entry = findKey( ctx, key, end-start, hash );
+
+    if (*entry != 0) return (uint32_t) *entry - 1;
+
+    if (ctx->keysIdx == ctx->keysSz)
+    {
+        if (ctx->keysSz >= 0x80000000) return 0xFFFFFFFF;
+
+        uint32_t newSz = 2*ctx->keysSz;
+        uint64_t* keys = (uint64_t*) align_alloc( MAX_CACHE_LINE_SIZE, 2*(uint64_t) newSz*sizeof(uint64_t) );
+
+        if (keys == nullptr) return 0xFFFFFFFF;
+
+        memcpy( keys, ctx->keys, 2*(uint64_t) ctx->keysIdx*sizeof(uint64_t) );
+        align_free( ctx->keys );
+
+        ctx->keys = keys;
+        ctx->keysSz = newSz;
+    }
+
+    uint32_t id = ctx->keysIdx++;
+    ctx->keys[2*id] = start;
+    ctx->keys[2*id+1] = end;
+
+    // The table is kept at most half full
+    if (2*ctx->keysIdx > ctx->keysTableSz)
+    {
+        if (!growKeyTable( ctx )) return 0xFFFFFFFF;
+    }
+    else *entry = ((uint64_t) hash << 32) | (id + 1);
+
+    return id;
+}
+
+
+static bool resetKeys( struct JsonContext* ctx )
+{
+    ctx->keysIdx = 0;
+
+    if (ctx->keys == nullptr)
+    {
+        ctx->keys = (uint64_t*) align_alloc( MAX_CACHE_LINE_SIZE, 2*64*sizeof(uint64_t) );
+        ctx->keysSz = 64;
+    }
+
+    if (ctx->keysTable == nullptr) return ctx->keys != nullptr && growKeyTable( ctx );
+
+    memset( ctx->keysTable, 0, ctx->keysTableSz*sizeof(uint64_t) );
+
+    return ctx->keys != nullptr;
+}
+
+
+// Members are either TURBOJSON_DOM_MEMBER or, with interned keys, TURBOJSON_DOM_MEMBER_KEY entries
+template <typename T>
+static inline T memberValue( const T* dom, T m )
+{
+    return dom[m] == TURBOJSON_DOM_MEMBER ? dom[m+3] : dom[m+2];
+}
+
+
+template <typename T>
+static inline T memberNext( const T* dom, T m )
+{
+    return dom[m] == TURBOJSON_DOM_MEMBER ? dom[m+4] : dom[m+3];
+}
+
+
+template <typename T>
+static inline void memberKey( const T* dom, const uint64_t* keys, T m, uint64_t* start, uint64_t* end )
+{
+    if (dom[m] == TURBOJSON_DOM_MEMBER)
+    {
+        *start = dom[m+1];
+        *end = dom[m+2];
+    }
+    else
+    {
+        *start = keys[2*(uint64_t) dom[m+1]];
+        *end = keys[2*(uint64_t) dom[m+1]+1];
+    }
+}
+
+
+extern "C" void turbojson_parsefile( struct JsonContext* ctx, const char* jsonfilename )
+{
+    FILE* in = fopen( jsonfilename, "rb" );
+
+    if (in)
+    {
+        fseek( in, 0, SEEK_END );
+        size_t filesize = ftell( in );
+        fseek( in, 0, SEEK_SET );
+
+        if (filesize > 0)
+        {
+            size_t allocfilesize = filesize + (filesize/2);
+            uint8_t* buffer = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, allocfilesize );
+
+            if (buffer != nullptr)
+            {
+                size_t readsize = fread( buffer, 1, filesize, in );
+
+                if (readsize == filesize)
+                {
+                    turbojson_parsebuffer( ctx, buffer, filesize, allocfilesize );
+                }
+            }
+        }
+
+        fclose( in );
+    }
+}
+
+
+// The end offset of the source of a container has its top bit set when the source holds no whitespace
+#define TURBOJSON_DOM_MINIFIED( T ) ((T) 1 << (sizeof(T)*8 - 1))
+
+
+template <typename T>
+bool JsonTape<T>::reserve( T n )
+{
+    return reserveTape( *this, n );
+}
+
+
+// Strings, numbers and literals all store the offsets of their source
+template <typename T>
+T JsonTape<T>::scalar( const uint8_t*, uint32_t type, T start, T end )
+{
+    T oIdx = domIdx;
+
+    domIdx += 3;
+    dom[oIdx] = type;
+    dom[oIdx+1] = start;
+    dom[oIdx+2] = end;
+
+    return oIdx;
+}
+
+
+template <typename T>
+T JsonTape<T>::beginContainer( uint32_t type, T start )
+{
+    T oIdx = domIdx;
+
+    domIdx += 4;
+    dom[oIdx] = type;
+    dom[oIdx+1] = TURBOJSON_NIL(T); // The members or elements are stored in a linked list
+    dom[oIdx+2] = start; // The source of the container in jsonbuffer
+
+    return oIdx;
+}
+
+
+template <typename T>
+void JsonTape<T>::endContainer( T idx, uint32_t, T end, bool minified )
+{
+    dom[idx+3] = end | (minified ? TURBOJSON_DOM_MINIFIED(T) : 0);
+}
+
+
+template <typename T>
+T JsonTape<T>::member( const uint8_t*, T keyStart, T keyEnd )
+{
+    T oIdx = domIdx;
+
+    if (keys)
+    {
+        uint32_t id = internKey( keys, keyStart, keyEnd );
+
+        if (id == 0xFFFFFFFF)
+        {
+            overflow = true;
+            return TURBOJSON_NIL(T);
+        }
+
+        domIdx += 4;
+        dom[oIdx] = TURBOJSON_DOM_MEMBER_KEY;
+        dom[oIdx+1] = id;
+        dom[oIdx+2] = TURBOJSON_NIL(T); // Child index
+        dom[oIdx+3] = TURBOJSON_NIL(T); // The next member
+    }
+    else
+    {
+        domIdx += 5;
+        dom[oIdx] = TURBOJSON_DOM_MEMBER;
+        dom[oIdx+1] = keyStart; // The indice of the id string
+        dom[oIdx+2] = keyEnd; // The indice of the end of the id string
+        dom[oIdx+3] = TURBOJSON_NIL(T); // Child index
+        dom[oIdx+4] = TURBOJSON_NIL(T); // The next member
+    }
+
+    return oIdx;
+}
+
+
+template <typename T>
+T JsonTape<T>::element()
+{
+    T oIdx = domIdx;
+
+    domIdx += 3;
+    dom[oIdx] = TURBOJSON_DOM_ARRAY_ELEMENT;
+    dom[oIdx+1] = TURBOJSON_NIL(T);
+    dom[oIdx+2] = TURBOJSON_NIL(T); // The next element
+
+    return oIdx;
+}
+
+
+template <typename T>
+void JsonTape<T>::link( T container, T prev, T item, uint32_t type )
+{
+    if (dom[container+1] == TURBOJSON_NIL(T)) dom[container+1] = item;
+    else dom[prev + (type == TURBOJSON_DOM_ARRAY ? 2 : (keys ? 3 : 4))] = item;
+}
+
+
+template <typename T>
+static void parseTape( struct JsonContext* ctx, T** dom )
+{
+    JsonTape<T> tape;
+
+    tape.dom = *dom;
+    tape.domIdx = 0;
+    tape.domSz = (T) ctx->domSz;
+    tape.overflow = false;
+    tape.spaces = 0;
+    tape.keys = nullptr;
+
+    if (ctx->flags & TURBOJSON_INTERN_KEYS)
+    {
+        if (!resetKeys( ctx ))
+        {
+            ctx->domIdx = 0;
+            return;
+        }
+        tape.keys = ctx;
+    }
+
+    T i = 0;
+    T size = (T) ctx->jsonbufferSize;
+
+    turbojson_parseChildElement( (const uint8_t*) ctx->jsonbuffer, &i, size, tape );
+
+    *dom = tape.dom;
+    ctx->domIdx = tape.overflow ? 0 : tape.domIdx;
+    ctx->domSz = tape.domSz;
+}
+
+
+/*
+Upper bound of the tape entries of a valid document. Each member or element comes after a '{',
+a '[' or a ',' and takes at most 9 entries with its value, and no document needs more than 4
+entries per input byte. Commas in strings only make the bound larger, and reserveTape still
+grows the tape for invalid input that goes past it.
+*/
+static uint64_t tapeBound( const uint8_t* buffer, uint64_t size )
+{
+    uint64_t n = 0;
+
+    for (uint64_t k=0; k<size; k++) n += (buffer[k] == ',') | (buffer[k] == '[') | (buffer[k] == '{');
+
+    return 9*n + 8 < 4*size + 8 ? 9*n + 8 : 4*size + 8;
+}
+
+
+extern "C" void turbojson_parsebuffer( struct JsonContext* ctx, uint8_t* jsonbuffer, uint64_t size, uint64_t allocsize )
+{
+    if (jsonbuffer != nullptr && size > 0 && allocsize > 0)
+    {
+        ctx->jsonbuffer = jsonbuffer;
+        ctx->jsonbufferSize = size;
+        ctx->jsonbufferMax = allocsize;
+
+        selectTape( ctx, size );
+
+        if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+        {
+            if (ctx->dom)
+            {
+                align_free(ctx->dom);
+                ctx->dom = nullptr;
+            }
+
+            // Sized once from the input, growing by copies would need about 3 times the tape at its peak
+            uint64_t bound = tapeBound( jsonbuffer, size );
+
+            if (ctx->dom64 != nullptr && ctx->domSz < bound)
+            {
+                align_free(ctx->dom64);
+                ctx->dom64 = nullptr;
+            }
+
+            if (ctx->dom64 == nullptr)
+            {
+                ctx->domSz = bound;
+                ctx->dom64 = (uint64_t*) align_alloc( MAX_CACHE_LINE_SIZE, ctx->domSz*sizeof(uint64_t) );
+            }
+
+            if (ctx->dom64 == nullptr) return;
+
+            parseTape( ctx, &ctx->dom64 );
+        }
+        else
+        {
+            if (ctx->dom64)
+            {
+                align_free(ctx->dom64);
+                ctx->dom64 = nullptr;
+            }
+
+            if (ctx->dom == nullptr)
+            {
+                ctx->dom = (uint32_t*) align_alloc( MAX_CACHE_LINE_SIZE, allocsize*sizeof(uint32_t) );
+                ctx->domSz = allocsize;
+            }
+
+            if (ctx->dom == nullptr) return;
+
+            parseTape( ctx, &ctx->dom );
+        }
+    }
+}
+
+
+// Forwards the events of the template parser to the C callbacks
+struct JsonEventAdapter {
+    const struct JsonEventHandlers* handlers;
+    void* userdata;
+
+    void startObject() { if (handlers->startObject) handlers->startObject( userdata ); }
+    void endObject() { if (handlers->endObject) handlers->endObject( userdata ); }
+    void startArray() { if (handlers->startArray) handlers->startArray( userdata ); }
+    void endArray() { if (handlers->endArray) handlers->endArray( userdata ); }
+    void key( const uint8_t* start, uint64_t len ) { if (handlers->key) handlers->key( userdata, start, len ); }
+    void string( const uint8_t* start, uint64_t len ) { if (handlers->string) handlers->string( userdata, start, len ); }
+    void number( const uint8_t* start, uint64_t len ) { if (handlers->number) handlers->number( userdata, start, len ); }
+    void literal( const uint8_t* start, uint64_t len ) { if (handlers->literal) handlers->literal( userdata, start, len ); }
+};
+
+
+extern "C" void turbojson_parse_events( const uint8_t* buffer, uint64_t len, const struct JsonEventHandlers* handlers, void* userdata )
+{
+    struct JsonEventAdapter adapter = { handlers, userdata };
+    turbojson_parse_events( buffer, len, adapter );
+}
+
+
+template <typename T>
+static uint64_t getMember( const struct JsonContext* ctx, const T* dom, uint64_t objIdx, const uint8_t* key, uint64_t len )
+{
+    uint64_t ks, ke;
+
+    if (objIdx >= ctx->domIdx || dom[objIdx] != TURBOJSON_DOM_OBJECT) return TURBOJSON_NOT_FOUND;
+
+    for (T ci = dom[objIdx+1]; ci != TURBOJSON_NIL(T); ci = memberNext( dom, ci ))
+    {
+        memberKey( dom, ctx->keys, ci, &ks, &ke );
+        if (ke-ks == len && memcmp( ctx->jsonbuffer+ks, key, len ) == 0) return memberValue( dom, ci );
+    }
+
+    return TURBOJSON_NOT_FOUND;
+}
+
+
+// With interned keys, members are matched by comparing key ids
+template <typename T>
+static uint64_t getMemberById( const struct JsonContext* ctx, const T* dom, uint64_t objIdx, uint64_t keyId )
+{
+    if (objIdx >= ctx->domIdx || dom[objIdx] != TURBOJSON_DOM_OBJECT) return TURBOJSON_NOT_FOUND;
+
+    for (T ci = dom[objIdx+1]; ci != TURBOJSON_NIL(T); ci = dom[ci+3])
+    {
+        if (dom[ci+1] == keyId) return dom[ci+2];
+    }
+
+    return TURBOJSON_NOT_FOUND;
+}
+
+
+extern "C" uint64_t turbojson_keyId( const struct JsonContext* ctx, const char* key, uint64_t len )
+{
+    if (!(ctx->flags & TURBOJSON_INTERN_KEYS) || ctx->keysTable == nullptr) return TURBOJSON_NOT_FOUND;
+
+    uint64_t entry = *findKey( ctx, (const uint8_t*) key, len, keyHash( (const uint8_t*) key, len ) );
+
+    return entry ? (uint32_t) entry - 1 : TURBOJSON_NOT_FOUND;
+}
+
+
+extern "C" uint64_t turbojson_getMemberById( const struct JsonContext* ctx, uint64_t objIdx, uint64_t keyId )
+{
+    uint64_t idx;
+
+    if (!(ctx->flags & TURBOJSON_INTERN_KEYS) || keyId >= ctx->keysIdx) return TURBOJSON_NOT_FOUND;
+
+    if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+        idx = getMemberById( ctx, ctx->dom64, objIdx, keyId );
+    else
+        idx = getMemberById( ctx, ctx->dom, objIdx, keyId );
+
+    return idx < ctx->domIdx ? idx : TURBOJSON_NOT_FOUND;
+}
+
+
+extern "C" uint64_t turbojson_getMember( const struct JsonContext* ctx, uint64_t objIdx, const char* key, uint64_t len )
+{
+    uint64_t idx;
+
+    if (ctx->flags & TURBOJSON_INTERN_KEYS) return turbojson_getMemberById( ctx, objIdx, turbojson_keyId( ctx, key, len ) );
+
+    if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+        idx = getMember( ctx, ctx->dom64, objIdx, (const uint8_t*) key, len );
+    else
+        idx = getMember( ctx, ctx->dom, objIdx, (const uint8_t*) key, len );
+
+    return idx < ctx->domIdx ? idx : TURBOJSON_NOT_FOUND;
+}
+
+
+static const double turbojson_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/*
+Locale independent number conversions. sprintf and strtod follow LC_NUMERIC, under a comma
+decimal locale they would write and read "1,5". std::to_chars and std::from_chars give the
+shortest round trip and ignore the locale, without them the decimal point is swapped around
+the C functions.
+*/
+
+static char localeDecimalPoint()
+{
+    const char* point = localeconv()->decimal_point;
+    return point && point[0] && !point[1] ? point[0] : '.';
+}
+
+
+static double strtodNoLocale( const char* s, uint64_t len )
+{
+    char local[64];
+    char* number = local;
+    char point = localeDecimalPoint();
+    double d;
+
+    if (len >= sizeof(local)) number = (char*) malloc( len+1 );
+    if (number == nullptr) return 0.0;
+
+    for (uint64_t k=0; k<len; k++) number[k] = s[k] == '.' ? point : s[k];
+    number[len] = 0;
+    d = strtod( number, nullptr );
+
+    if (number != local) free( number );
+
+    return d;
+}
+
+
+static double textToDouble( const char* s, uint64_t len )
+{
+#if defined(__cpp_lib_to_chars)
+    double d = 0.0;
+    if (std::from_chars( s, s+len, d ).ec == std::errc()) return d;
+#endif
+    // Out of range values go through strtod, which gives infinities and zeros for them
+    return strtodNoLocale( s, len );
+}
+
+
+// Writes the shortest text of a finite double that reads back exactly, returns its length, at most 24
+static uint32_t doubleToText( uint8_t* text, double d )
+{
+#if defined(__cpp_lib_to_chars)
+    return (uint32_t) (std::to_chars( (char*) text, (char*) text+24, d ).ptr - (char*) text);
+#else
+    char point = localeDecimalPoint();
+    int j = 0;
+
+    for (int precision = 15; precision <= 17; precision++)
+    {
+        j = snprintf( (char*) text, 25, "%.*g", precision, d );
+        for (int k=0; k<j; k++) if (text[k] == (uint8_t) point) text[k] = '.';
+        if (textToDouble( (const char*) text, j ) == d) break;
+    }
+
+    return (uint32_t) j;
+#endif
+}
+
+
+// Writes the decimal digits of v, returns their number, at most 20
+static uint32_t uint64ToText( uint8_t* text, uint64_t v )
+{
+    uint8_t digits[20];
+    uint32_t n = 0;
+
+    do {
+        digits[n++] = (uint8_t) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    for (uint32_t k=0; k<n; k++) text[k] = digits[n-1-k];
+
+    return n;
+}
+
+
+// Exact without calling textToDouble when the mantissa fits 53 bits and the decimal exponent is small
+static double numberToDouble( const uint8_t* s, const uint8_t* end )
+{
+    const uint8_t* p = s;
+    bool negative = false;
+    uint64_t mantissa = 0;
+    int64_t exponent = 0;
+    uint32_t digits = 0;
+
+    if (p < end && *p == '-') { negative = true; p++; }
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        if (digits < 19) { mantissa = mantissa*10 + (*p - '0'); if (mantissa) digits++; }
+        else exponent++;
+    }
+
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        {
+            if (digits < 19) { mantissa = mantissa*10 + (*p - '0'); if (mantissa) digits++; exponent--; }
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        bool negativeExponent = false;
+        int64_t e = 0;
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) negativeExponent = *p++ == '-';
+        for (; p < end && *p >= '0' && *p <= '9'; p++) if (e < 100000) e = e*10 + (*p - '0');
+        exponent += negativeExponent ? -e : e;
+    }
+
+    if (digits < 19 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double d = (double) mantissa;
+        d = exponent < 0 ? d / turbojson_pow10[-exponent] : d * turbojson_pow10[exponent];
+        return negative ? -d : d;
+    }
+
+    return textToDouble( (const char*) s, end-s );
+}
+
+
+static bool numberToInt64( const uint8_t* s, const uint8_t* end, int64_t* value )
+{
+    const uint8_t* p = s;
+    bool negative = false;
+    uint64_t v = 0;
+
+    if (p < end && *p == '-') { negative = true; p++; }
+
+    if (p == end) return false;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        if (v > (0xFFFFFFFFFFFFFFFFULL - 9) / 10) break;
+        v = v*10 + (*p - '0');
+    }
+
+    if (p == end)
+    {
+        if (v > (negative ? 0x8000000000000000ULL : 0x7FFFFFFFFFFFFFFFULL)) return false;
+        *value = negative ? (int64_t) (0 - v) : (int64_t) v;
+        return true;
+    }
+
+    // Fractions, exponents and long numbers go through a double, integral values only
+    double d = numberToDouble( s, end );
+
+    if (d != d || d < -9223372036854775808.0 || d >= 9223372036854775808.0 || d != (double) (int64_t) d) return false;
+
+    *value = (int64_t) d;
+
+    return true;
+}
+
+
+// Number of member positions whose last matching column is remembered for the next row
+#define TURBOJSON_COLUMN_HINTS 64
+
+
+template <typename T>
+static void toColumns( const struct JsonContext* ctx, const T* dom, T arrayIdx, struct JsonColumn* columns, uint32_t ncolumns, const uint64_t* keyIds )
+{
+    const uint8_t* buffer = ctx->jsonbuffer;
+    uint32_t hints[TURBOJSON_COLUMN_HINTS];
+    uint64_t row = 0;
+    uint64_t ks, ke;
+
+    for (uint32_t p=0; p<TURBOJSON_COLUMN_HINTS; p++) hints[p] = p < ncolumns ? p : 0;
+
+    for (T ei = dom[arrayIdx+1]; ei != TURBOJSON_NIL(T); ei = dom[ei+2], row++)
+    {
+        T oi = dom[ei+1];
+
+        if (oi == TURBOJSON_NIL(T) || dom[oi] != TURBOJSON_DOM_OBJECT) continue;
+
+        uint32_t position = 0;
+
+        for (T mi = dom[oi+1]; mi != TURBOJSON_NIL(T); mi = memberNext( dom, mi ), position++)
+        {
+            uint32_t c = position < TURBOJSON_COLUMN_HINTS ? hints[position] : 0;
+            uint32_t tries = 0;
+
+            if (keyIds)
+            {
+                uint64_t id = dom[mi+1];
+                while (tries < ncolumns && keyIds[c] != id) { c = c+1 == ncolumns ? 0 : c+1; tries++; }
+            }
+            else
+            {
+                memberKey( dom, ctx->keys, mi, &ks, &ke );
+                while (tries < ncolumns && (columns[c].nameLen != ke-ks || memcmp( columns[c].name, buffer+ks, ke-ks ) != 0))
+                {
+                    c = c+1 == ncolumns ? 0 : c+1;
+                    tries++;
+                }
+            }
+
+            if (tries == ncolumns) continue;
+
+            if (position < TURBOJSON_COLUMN_HINTS) hints[position] = c;
+
+            struct JsonColumn* column = &columns[c];
+            T vi = memberValue( dom, mi );
+            bool valid = false;
+
+            if (vi == TURBOJSON_NIL(T)) continue;
+
+            switch (column->type)
+            {
+            case TURBOJSON_COLUMN_INT64:
+                if (dom[vi] == TURBOJSON_DOM_REAL) valid = numberToInt64( buffer+dom[vi+1], buffer+dom[vi+2], (int64_t*) column->values + row );
+                break;
+            case TURBOJSON_COLUMN_DOUBLE:
+                if (dom[vi] == TURBOJSON_DOM_REAL)
+                {
+                    ((double*) column->values)[row] = numberToDouble( buffer+dom[vi+1], buffer+dom[vi+2] );
+                    valid = true;
+                }
+                break;
+            case TURBOJSON_COLUMN_STRING:
+                if (dom[vi] == TURBOJSON_DOM_STRING && dom[vi+2]-dom[vi+1] <= 0xFFFFFFFF)
+                {
+                    column->stringOffsets[row] = dom[vi+1];
+                    column->stringLengths[row] = dom[vi+2]-dom[vi+1];
+                    valid = true;
+                }
+                break;
+            default:
+                break;
+            }
+
+            if (valid && !(column->validity[row >> 3] & (1 << (row & 7))))
+            {
+                column->validity[row >> 3] |= 1 << (row & 7);
+                column->nullCount--;
+            }
+        }
+    }
+}
+
+
+extern "C" void turbojson_freeColumns( struct JsonColumn* columns, uint32_t ncolumns )
+{
+    for (uint32_t c=0; c<ncolumns; c++)
+    {
+        if (columns[c].validity) align_free( columns[c].validity );
+        if (columns[c].values) align_free( columns[c].values );
+        if (columns[c].stringOffsets) align_free( columns[c].stringOffsets );
+        if (columns[c].stringLengths) align_free( columns[c].stringLengths );
+        columns[c].validity = nullptr;
+        columns[c].values = nullptr;
+        columns[c].stringOffsets = nullptr;
+        columns[c].stringLengths = nullptr;
+    }
+}
+
+
+static inline void* allocColumnBuffer( uint64_t size )
+{
+    size = (size + MAX_CACHE_LINE_SIZE - 1) & ~((uint64_t) MAX_CACHE_LINE_SIZE - 1);
+    void* buffer = align_alloc( MAX_CACHE_LINE_SIZE, size );
+    if (buffer) memset( buffer, 0, size );
+    return buffer;
+}
+
+
+extern "C" bool turbojson_to_columns( const struct JsonContext* ctx, uint64_t arrayIdx, struct JsonColumn* columns, uint32_t ncolumns )
+{
+    bool large = (ctx->flags & TURBOJSON_LARGE_DOCUMENT) != 0;
+    uint64_t rows = 0;
+    uint64_t* keyIds = nullptr;
+    bool ok = true;
+
+    if (arrayIdx >= ctx->domIdx) return false;
+    if ((large ? ctx->dom64[arrayIdx] : ctx->dom[arrayIdx]) != TURBOJSON_DOM_ARRAY) return false;
+
+    if (large)
+    {
+        for (uint64_t ei = ctx->dom64[arrayIdx+1]; ei != TURBOJSON_NIL(uint64_t); ei = ctx->dom64[ei+2]) rows++;
+    }
+    else
+    {
+        for (uint32_t ei = ctx->dom[arrayIdx+1]; ei != TURBOJSON_NIL(uint32_t); ei = ctx->dom[ei+2]) rows++;
+    }
+
+    for (uint32_t c=0; c<ncolumns; c++)
+    {
+        struct JsonColumn* column = &columns[c];
+
+        column->length = rows;
+        column->nullCount = rows;
+        column->validity = (uint8_t*) allocColumnBuffer( (rows+7)/8 );
+        column->values = nullptr;
+        column->stringOffsets = nullptr;
+        column->stringLengths = nullptr;
+
+        if (column->type == TURBOJSON_COLUMN_STRING)
+        {
+            column->stringOffsets = (uint64_t*) allocColumnBuffer( rows*sizeof(uint64_t) );
+            column->stringLengths = (uint32_t*) allocColumnBuffer( rows*sizeof(uint32_t) );
+            ok = ok && column->stringOffsets && column->stringLengths;
+        }
+        else
+        {
+            column->values = allocColumnBuffer( rows*sizeof(uint64_t) );
+            ok = ok && column->values;
+        }
+
+        ok = ok && column->validity;
+    }
+
+    // Interned keys are matched by id, a column whose name isn't in the dictionary matches nothing
+    if (ok && ncolumns > 0 && (ctx->flags & TURBOJSON_INTERN_KEYS))
+    {
+        keyIds = (uint64_t*) malloc( ncolumns*sizeof(uint64_t) );
+        ok = keyIds != nullptr;
+        for (uint32_t c=0; ok && c<ncolumns; c++) keyIds[c] = turbojson_keyId( ctx, columns[c].name, columns[c].nameLen );
+    }
+
+    if (!ok)
+    {
+        turbojson_freeColumns( columns, ncolumns );
+        return false;
+    }
+
+    if (ncolumns > 0)
+    {
+        if (large)
+            toColumns( ctx, ctx->dom64, arrayIdx, columns, ncolumns, keyIds );
+        else
+            toColumns( ctx, ctx->dom, (uint32_t) arrayIdx, columns, ncolumns, keyIds );
+    }
+
+    free( keyIds );
+
+    return true;
+}
+
+
+extern "C" void turbojson_stringify( struct JsonContext* ctx )
+{
+    turbojson_pretty(ctx, false, 0, false);
+}
+
+
+// The 8 byte copies of turbojson_memcpy may write up to 7 bytes past the end of the output
+#define TURBOJSON_OUTPUT_PADDING 64
+
+
+// An output buffer of prettyRec, jsonout or the buffer of a chunk of the parallel path
+struct JsonPrettyOutput {
+    uint8_t* out;
+    uint64_t max;
+};
+
+
+static bool growPrettyOutput( JsonPrettyOutput& o, uint64_t j, uint64_t n )
+{
+    uint64_t newMax = (2*o.max + n + TURBOJSON_OUTPUT_PADDING + MAX_CACHE_LINE_SIZE-1) & ~(uint64_t) (MAX_CACHE_LINE_SIZE-1);
+    if (newMax < 65536) newMax = 65536;
+
+    uint8_t* out = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, newMax );
+    if (out == nullptr) return false;
+
+    if (o.out)
+    {
+        memcpy( out, o.out, j );
+        align_free( o.out );
+    }
+
+    o.out = out;
+    o.max = newMax;
+
+    return true;
+}
+
+
+// Makes room for n more bytes after the first j, which are kept
+static inline bool reservePrettyOutput( JsonPrettyOutput& o, uint64_t j, uint64_t n )
+{
+    if (o.out != nullptr && j + n + TURBOJSON_OUTPUT_PADDING <= o.max) return true;
+    return growPrettyOutput( o, j, n );
+}
+
+
+static inline void prettyIndent( uint8_t* jsonout, uint64_t &j, uint32_t ident, bool spaces, uint32_t numberSpaces )
+{
+    uint64_t n = (uint64_t) ident*numberSpaces;
+    memset( jsonout+j, spaces ? ' ' : '\t', n );
+    j += n;
+}
+
+
+// The comma after all but the last member or element, then the line return
+static inline void prettySeparator( uint8_t* jsonout, uint64_t &j, bool comma, bool linereturn )
+{
+    uint64_t k = j;
+    if (comma) jsonout[k++] = ',';
+    if (linereturn) jsonout[k++] = '\n';
+    j = k;
+}
+
+
+template <typename T>
+static bool prettyRec( JsonPrettyOutput& o, const T* dom, const uint8_t* jsonbuffer, const uint64_t* keys, T i, uint64_t &j, uint32_t ident, bool spaces, uint32_t numberSpaces, bool linereturn );
+
+
+// Writes the members from ci up to stop, each on its own line when linereturn is set
+template <typename T>
+static bool prettyMembers( JsonPrettyOutput& o, const T* dom, const uint8_t* jsonbuffer, const uint64_t* keys, T ci, T stop, uint64_t &j, uint32_t ident, bool spaces, uint32_t numberSpaces, bool linereturn )
+{
+    uint64_t sz, ks, ke;
+
+    while (ci != stop)
+    {
+        memberKey( dom, keys, ci, &ks, &ke );
+        sz = ke-ks+2;
+        if (!reservePrettyOutput( o, j, (uint64_t) ident*numberSpaces + sz + 3 )) return false;
+
+        // Written through locals, the byte stores could otherwise alias the output pointer and j
+        uint8_t* out = o.out;
+        uint64_t k = j;
+        prettyIndent( out, k, ident, spaces, numberSpaces );
+        turbojson_memcpy(out+k, jsonbuffer+ks-1, jsonbuffer+ks-1+sz);
+        k += sz;
+        if (numberSpaces) out[k++] = ' ';
+        out[k++] = ':';
+        if (numberSpaces) out[k++] = ' ';
+        j = k;
+
+        if (!prettyRec( o, dom, jsonbuffer, keys, memberValue( dom, ci ), j, ident, spaces, numberSpaces, linereturn )) return false;
+        if (!reservePrettyOutput( o, j, 2 )) return false;
+        ci = memberNext( dom, ci );
+        prettySeparator( o.out, j, ci != TURBOJSON_NIL(T), linereturn );
+    }
+
+    return true;
+}
+
+
+template <typename T>
+static bool prettyElements( JsonPrettyOutput& o, const T* dom, const uint8_t* jsonbuffer, const uint64_t* keys, T ci, T stop, uint64_t &j, uint32_t ident, bool spaces, uint32_t numberSpaces, bool linereturn )
+{
+    while (ci != stop)
+    {
+        if (!reservePrettyOutput( o, j, (uint64_t) ident*numberSpaces )) return false;
+        prettyIndent( o.out, j, ident, spaces, numberSpaces );
+        if (!prettyRec( o, dom, jsonbuffer, keys, dom[ci+1], j, ident, spaces, numberSpaces, linereturn )) return false;
+        if (!reservePrettyOutput( o, j, 2 )) return false;
+        ci = dom[ci+2];
+        prettySeparator( o.out, j, ci != TURBOJSON_NIL(T), linereturn );
+    }
+
+    return true;
+}
+
+
+// Siblings are walked iteratively so that the recursion depth is the nesting depth of the document
+template <typename T>
+static bool prettyRec( JsonPrettyOutput& o, const T* dom, const uint8_t* jsonbuffer, const uint64_t* keys, T i, uint64_t &j, uint32_t ident, bool spaces, uint32_t numberSpaces, bool linereturn )
+{
+    uint64_t sz;
+    T ci;
+
+    if (i == TURBOJSON_NIL(T)) return true;
+
+    // Without reformatting, a container whose source is already minified is copied as is
+    if ((dom[i] == TURBOJSON_DOM_OBJECT || dom[i] == TURBOJSON_DOM_ARRAY) && !numberSpaces && !linereturn && (dom[i+3] & TURBOJSON_DOM_MINIFIED(T)))
+    {
+        sz = (dom[i+3] & ~TURBOJSON_DOM_MINIFIED(T)) - dom[i+2];
+        if (!reservePrettyOutput( o, j, sz )) return false;
+        unaligned_memcpy( o.out+j, jsonbuffer+dom[i+2], sz );
+        j += sz;
+        return true;
+    }
+
+    switch (dom[i])
+    {
+    case TURBOJSON_DOM_STRING:
+        sz = dom[i+2]-dom[i+1]+2;
+        if (!reservePrettyOutput( o, j, sz )) return false;
+        turbojson_memcpy(o.out+j, jsonbuffer+dom[i+1]-1, jsonbuffer+dom[i+1]-1+sz);
+        j += sz;
+        break;
+    case TURBOJSON_DOM_REAL:
+    case TURBOJSON_DOM_LITERAL:
+        sz = dom[i+2]-dom[i+1];
+        if (!reservePrettyOutput( o, j, sz )) return false;
+        turbojson_memcpy(o.out+j, jsonbuffer+dom[i+1], jsonbuffer+dom[i+1]+sz);
+        j += sz;
+        break;
+    case TURBOJSON_DOM_OBJECT:
+    case TURBOJSON_DOM_ARRAY:
+        if (!reservePrettyOutput( o, j, 2 )) return false;
+        o.out[j++] = dom[i] == TURBOJSON_DOM_OBJECT ? '{' : '[';
+        ci = dom[i+1];
+        if (ci == TURBOJSON_NIL(T)) { o.out[j++] = dom[i] == TURBOJSON_DOM_OBJECT ? '}' : ']'; break; }
+        if (linereturn) o.out[j++] = '\n';
+        if (dom[i] == TURBOJSON_DOM_OBJECT)
+        {
+            if (!prettyMembers( o, dom, jsonbuffer, keys, ci, TURBOJSON_NIL(T), j, ident+1, spaces, numberSpaces, linereturn )) return false;
+        }
+        else if (!prettyElements( o, dom, jsonbuffer, keys, ci, TURBOJSON_NIL(T), j, ident+1, spaces, numberSpaces, linereturn )) return false;
+        if (!reservePrettyOutput( o, j, (uint64_t) ident*numberSpaces + 1 )) return false;
+        prettyIndent( o.out, j, ident, spaces, numberSpaces );
+        o.out[j++] = dom[i] == TURBOJSON_DOM_OBJECT ? '}' : ']';
+        break;
+    default:
+        break;
+    }
+
+    return true;
+}
+
+
+// Size of the output of prettyRec, which follows the same walk, for the chunks of the parallel path
+template <typename T>
+static uint64_t prettySize( const T* dom, const uint64_t* keys, T i, uint32_t ident, uint32_t numberSpaces, bool linereturn );
+
+
+template <typename T>
+static uint64_t prettyMembersSize( const T* dom, const uint64_t* keys, T ci, T stop, uint32_t ident, uint32_t numberSpaces, bool linereturn )
+{
+    uint64_t sz = 0, ks, ke;
+
+    while (ci != stop)
+    {
+        memberKey( dom, keys, ci, &ks, &ke );
+        sz += (uint64_t) ident*numberSpaces + ke-ks+2 + (numberSpaces ? 3 : 1);
+        sz += prettySize( dom, keys, memberValue( dom, ci ), ident, numberSpaces, linereturn );
+        ci = memberNext( dom, ci );
+        if (ci != TURBOJSON_NIL(T)) sz++;
+        if (linereturn) sz++;
+    }
+
+    return sz;
+}
+
+
+template <typename T>
+static uint64_t prettyElementsSize( const T* dom, const uint64_t* keys, T ci, T stop, uint32_t ident, uint32_t numberSpaces, bool linereturn )
+{
+    uint64_t sz = 0;
+
+    while (ci != stop)
+    {
+        sz += (uint64_t) ident*numberSpaces;
+        sz += prettySize( dom, keys, dom[ci+1], ident, numberSpaces, linereturn );
+        ci = dom[ci+2];
+        if (ci != TURBOJSON_NIL(T)) sz++;
+        if (linereturn) sz++;
+    }
+
+    return sz;
+}
+
+
+template <typename T>
+static uint64_t prettySize( const T* dom, const uint64_t* keys, T i, uint32_t ident, uint32_t numberSpaces, bool linereturn )
+{
+    if (i == TURBOJSON_NIL(T)) return 0;
+
+    if ((dom[i] == TURBOJSON_DOM_OBJECT || dom[i] == TURBOJSON_DOM_ARRAY) && !numberSpaces && !linereturn && (dom[i+3] & TURBOJSON_DOM_MINIFIED(T)))
+        return (dom[i+3] & ~TURBOJSON_DOM_MINIFIED(T)) - dom[i+2];
+
+    switch (dom[i])
+    {
+    case TURBOJSON_DOM_STRING:
+        return dom[i+2]-dom[i+1]+2;
+    case TURBOJSON_DOM_REAL:
+    case TURBOJSON_DOM_LITERAL:
+        return dom[i+2]-dom[i+1];
+    case TURBOJSON_DOM_OBJECT:
+        if (dom[i+1] == TURBOJSON_NIL(T)) return 2;
+        return 2 + (linereturn ? 1 : 0) + (uint64_t) ident*numberSpaces + prettyMembersSize( dom, keys, dom[i+1], TURBOJSON_NIL(T), ident+1, numberSpaces, linereturn );
+    case TURBOJSON_DOM_ARRAY:
+        if (dom[i+1] == TURBOJSON_NIL(T)) return 2;
+        return 2 + (linereturn ? 1 : 0) + (uint64_t) ident*numberSpaces + prettyElementsSize( dom, keys, dom[i+1], TURBOJSON_NIL(T), ident+1, numberSpaces, linereturn );
+    default:
+        return 0;
+    }
+}
+
+
+// Makes room for exactly sz output bytes, the previous content is not kept
+static bool reserveExactOutput( struct JsonContext* ctx, uint64_t sz )
+{
+    uint64_t reqoutsz = (sz + TURBOJSON_OUTPUT_PADDING + MAX_CACHE_LINE_SIZE-1) & ~(uint64_t) (MAX_CACHE_LINE_SIZE-1);
+
+    if (ctx->jsonout != nullptr && ctx->jsonoutMax >= reqoutsz) return true;
+
+    if (ctx->jsonout) align_free(ctx->jsonout);
+
+    ctx->jsonout = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, reqoutsz );
+    ctx->jsonoutMax = ctx->jsonout ? reqoutsz : 0;
+
+    return ctx->jsonout != nullptr;
+}
+
+
+extern "C" void turbojson_pretty( struct JsonContext* ctx, bool spaces, uint32_t numberSpaces, bool linereturn )
+{
+    JsonPrettyOutput o = { ctx->jsonout, ctx->jsonoutMax };
+    uint64_t j=0;
+    bool ok = true;
+
+    // The output is grown on demand, it usually is not much larger than the source
+    if (ctx->domIdx > 0)
+    {
+        ok = reservePrettyOutput( o, 0, ctx->jsonbufferSize + 1 );
+
+        if (ok && (ctx->flags & TURBOJSON_LARGE_DOCUMENT))
+            ok = prettyRec( o, ctx->dom64, ctx->jsonbuffer, ctx->keys, (uint64_t) 0, j, 0, spaces, numberSpaces, linereturn );
+        else if (ok)
+            ok = prettyRec( o, ctx->dom, ctx->jsonbuffer, ctx->keys, (uint32_t) 0, j, 0, spaces, numberSpaces, linereturn );
+
+        if (ok) ok = reservePrettyOutput( o, j, 1 );
+        if (ok && linereturn) o.out[j++] = '\n';
+    }
+
+    ctx->jsonout = o.out;
+    ctx->jsonoutMax = o.out ? o.max : 0;
+    ctx->jsonoutIdx = ok ? j : 0;
+}
+
+
+/*
+Parallel serialization. The children of the root container are split in chunks of about the
+same source size, each worker sizes its chunk at indentation level 1 and writes it into its own
+buffer. Once all the chunks are written, the same workers copy them into jsonout at offsets
+given by a prefix sum of their sizes.
+*/
+
+
+struct JsonPrettyChunk {
+    uint8_t* out;
+    uint64_t size;
+    uint64_t offset;
+};
+
+
+// Where the workers wait between writing their chunk and copying it
+struct JsonPrettyPhase {
+    std::mutex lock;
+    std::condition_variable cond;
+    uint32_t written; // Number of workers done writing their chunk
+    int state; // 0 while the chunks are written, then 1 to copy them or 2 to stop
+    uint8_t* jsonout;
+};
+
+
+// Offset in jsonbuffer where the value of a child of the root starts, 0 for a missing value
+template <typename T>
+static uint64_t childSource( const T* dom, T ci, bool object )
+{
+    T v = object ? memberValue( dom, ci ) : dom[ci+1];
+    if (v == TURBOJSON_NIL(T)) return 0;
+
+    return dom[v] == TURBOJSON_DOM_OBJECT || dom[v] == TURBOJSON_DOM_ARRAY ? dom[v+2] : dom[v+1];
+}
+
+
+template <typename T>
+static void prettyChunk( struct JsonContext* ctx, const T* dom, const T* starts, JsonPrettyChunk* chunks, JsonPrettyPhase* phase, uint32_t t, bool object, bool spaces, uint32_t numberSpaces, bool linereturn )
+{
+    const uint64_t* keys = (const uint64_t*) ctx->keys;
+    uint64_t sz = object ? prettyMembersSize( dom, keys, starts[t], starts[t+1], 1, numberSpaces, linereturn )
+                         : prettyElementsSize( dom, keys, starts[t], starts[t+1], 1, numberSpaces, linereturn );
+    JsonPrettyOutput o = { nullptr, 0 };
+    uint64_t j = 0;
+    bool done = reservePrettyOutput( o, 0, sz );
+
+    if (done && object) done = prettyMembers( o, dom, (const uint8_t*) ctx->jsonbuffer, keys, starts[t], starts[t+1], j, 1, spaces, numberSpaces, linereturn );
+    else if (done) done = prettyElements( o, dom, (const uint8_t*) ctx->jsonbuffer, keys, starts[t], starts[t+1], j, 1, spaces, numberSpaces, linereturn );
+
+    if (done)
+    {
+        chunks[t].out = o.out;
+        chunks[t].size = j;
+    }
+    else if (o.out) align_free( o.out );
+
+    std::unique_lock<std::mutex> guard( phase->lock );
+    phase->written++;
+    phase->cond.notify_all();
+    phase->cond.wait( guard, [phase]() { return phase->state != 0; } );
+    guard.unlock();
+
+    if (phase->state == 1) memcpy( phase->jsonout + chunks[t].offset, chunks[t].out, chunks[t].size );
+}
+
+
+template <typename T>
+static bool prettyParallel( struct JsonContext* ctx, const T* dom, bool spaces, uint32_t numberSpaces, bool linereturn, uint32_t nthreads )
+{
+    bool object = dom[0] == TURBOJSON_DOM_OBJECT;
+    T first = dom[1];
+
+    if ((!object && dom[0] != TURBOJSON_DOM_ARRAY) || first == TURBOJSON_NIL(T)) return false;
+
+    // Without reformatting, a minified root is a single copy
+    if (!numberSpaces && !linereturn && (dom[3] & TURBOJSON_DOM_MINIFIED(T))) return false;
+
+    uint64_t nchildren = 0;
+    for (T ci = first; ci != TURBOJSON_NIL(T); ci = object ? memberNext( dom, ci ) : dom[ci+2]) nchildren++;
+
+    if (nchildren < 2) return false;
+    if (nthreads > nchildren) nthreads = (uint32_t) nchildren;
+
+    // starts[k] is the first child of chunk k, starts[nthreads] the end of the list
+    T* starts = (T*) align_alloc( MAX_CACHE_LINE_SIZE, ((nthreads+1)*sizeof(T) + MAX_CACHE_LINE_SIZE-1) & ~(uint64_t) (MAX_CACHE_LINE_SIZE-1) );
+    JsonPrettyChunk* chunks = (JsonPrettyChunk*) align_alloc( MAX_CACHE_LINE_SIZE, (nthreads*sizeof(JsonPrettyChunk) + MAX_CACHE_LINE_SIZE-1) & ~(uint64_t) (MAX_CACHE_LINE_SIZE-1) );
+    std::thread* workers = new (std::nothrow) std::thread[nthreads];
+    JsonPrettyPhase* phase = new (std::nothrow) JsonPrettyPhase;
+    bool ok = starts != nullptr && chunks != nullptr && workers != nullptr && phase != nullptr;
+
+    if (ok)
+    {
+        uint64_t srcStart = dom[2];
+        uint64_t srcEnd = dom[3] & ~TURBOJSON_DOM_MINIFIED(T);
+        uint64_t span = srcEnd - srcStart;
+        uint32_t k = 1;
+        T prev = first;
+
+        starts[0] = first;
+
+        for (T ci = first; ci != TURBOJSON_NIL(T) && k < nthreads; ci = object ? memberNext( dom, ci ) : dom[ci+2])
+        {
+            if (ci != prev && childSource( dom, ci, object ) >= srcStart + k*span/nthreads)
+            {
+                starts[k++] = ci;
+                prev = ci;
+            }
+        }
+
+        nthreads = k;
+        starts[nthreads] = TURBOJSON_NIL(T);
+
+        for (uint32_t t=0; t<nthreads; t++)
+        {
+            chunks[t].out = nullptr;
+            chunks[t].size = 0;
+            chunks[t].offset = 0;
+        }
+
+        phase->written = 0;
+        phase->state = 0;
+        phase->jsonout = nullptr;
+
+        // Thread creation may throw, which must not cross the C interface, the serial path then runs instead
+        uint32_t started = 0;
+
+        try {
+            for (; started<nthreads; started++)
+                workers[started] = std::thread( prettyChunk<T>, ctx, dom, starts, chunks, phase, started, object, spaces, numberSpaces, linereturn );
+        }
+        catch (...) {
+            ok = false;
+        }
+
+        std::unique_lock<std::mutex> guard( phase->lock );
+        phase->cond.wait( guard, [phase, started]() { return phase->written == started; } );
+
+        for (uint32_t t=0; t<nthreads; t++)
+            if (chunks[t].out == nullptr) ok = false;
+
+        // The opening bracket and line return, then the chunks, then the closing bracket and line returns
+        uint64_t j = linereturn ? 2 : 1;
+
+        for (uint32_t t=0; t<nthreads && ok; t++)
+        {
+            chunks[t].offset = j;
+            j += chunks[t].size;
+        }
+
+        if (ok && reserveExactOutput( ctx, j + 2 ))
+        {
+            phase->jsonout = ctx->jsonout;
+            phase->state = 1;
+        }
+        else phase->state = 2;
+
+        phase->cond.notify_all();
+        guard.unlock();
+
+        if (phase->state == 1)
+        {
+            uint8_t* jsonout = ctx->jsonout;
+
+            jsonout[0] = object ? '{' : '[';
+            if (linereturn) jsonout[1] = '\n';
+            jsonout[j++] = object ? '}' : ']';
+            if (linereturn) jsonout[j++] = '\n';
+        }
+
+        for (uint32_t t=0; t<started; t++) workers[t].join();
+
+        // Only a failed jsonout allocation is not retried on the serial path
+        ctx->jsonoutIdx = phase->state == 1 ? j : 0;
+
+        for (uint32_t t=0; t<nthreads; t++)
+            if (chunks[t].out) align_free(chunks[t].out);
+    }
+
+    if (starts) align_free(starts);
+    if (chunks) align_free(chunks);
+    delete[] workers;
+    delete phase;
+
+    return ok;
+}
+
+
+extern "C" void turbojson_pretty_parallel( struct JsonContext* ctx, bool spaces, uint32_t numberSpaces, bool linereturn, uint32_t nthreads )
+{
+    bool done = false;
+
+    if (nthreads == 0) nthreads = std::thread::hardware_concurrency();
+
+    if (nthreads > 1 && ctx->domIdx > 0)
+    {
+        if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+            done = prettyParallel( ctx, (const uint64_t*) ctx->dom64, spaces, numberSpaces, linereturn, nthreads );
+        else
+            done = prettyParallel( ctx, (const uint32_t*) ctx->dom, spaces, numberSpaces, linereturn, nthreads );
+    }
+
+    if (!done) turbojson_pretty( ctx, spaces, numberSpaces, linereturn );
+}
+
+
+extern "C" void turbojson_stringify_parallel( struct JsonContext* ctx, uint32_t nthreads )
+{
+    turbojson_pretty_parallel( ctx, false, 0, false, nthreads );
+}
+
+
+/*
+Canonical form, shared by turbojson_canonical and turbojson_hash: strings are unescaped then
+re-escaped minimally, numbers are printed from their exact decimal value the way ECMAScript
+prints them (1.0, 10e-1 and 1 are all 1) and object members are ordered by key.
+*/
+
+
+static inline bool decodeHex4( const uint8_t* s, uint32_t* cp )
+{
+    uint32_t v = 0;
+
+    for (uint32_t k=0; k<4; k++)
+    {
+        uint8_t c = s[k];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return false;
+    }
+
+    *cp = v;
+
+    return true;
+}
+
+
+static inline uint32_t encodeUtf8( uint32_t cp, uint8_t* utf8 )
+{
+    if (cp < 0x80) { utf8[0] = cp; return 1; }
+    if (cp < 0x800) { utf8[0] = 0xC0 | (cp >> 6); utf8[1] = 0x80 | (cp & 0x3F); return 2; }
+    if (cp < 0x10000) { utf8[0] = 0xE0 | (cp >> 12); utf8[1] = 0x80 | ((cp >> 6) & 0x3F); utf8[2] = 0x80 | (cp & 0x3F); return 3; }
+    utf8[0] = 0xF0 | (cp >> 18); utf8[1] = 0x80 | ((cp >> 12) & 0x3F); utf8[2] = 0x80 | ((cp >> 6) & 0x3F); utf8[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+
+// Decodes the escape sequence whose backslash is at s into UTF-8, returns the number of bytes of s consumed
+static uint32_t decodeEscape( const uint8_t* s, const uint8_t* end, uint8_t* utf8, uint32_t* utf8len )
+{
+    uint32_t consumed = 2;
+    uint32_t cp, lo;
+
+    if (s+1 >= end)
+    {
+        *utf8len = 0;
+        return 1;
+    }
+
+    switch (s[1])
+    {
+    case 'b': cp = 0x08; break;
+    case 'f': cp = 0x0C; break;
+    case 'n': cp = 0x0A; break;
+    case 'r': cp = 0x0D; break;
+    case 't': cp = 0x09; break;
+    case 'u':
+        cp = 0xFFFD; // Malformed escapes and lone surrogates are replaced
+        if (s+6 <= end && decodeHex4( s+2, &cp ))
+        {
+            consumed = 6;
+            if (cp >= 0xD800 && cp < 0xDC00)
+            {
+                if (s+12 <= end && s[6] == '\\' && s[7] == 'u' && decodeHex4( s+8, &lo ) && lo >= 0xDC00 && lo < 0xE000)
+                {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    consumed = 12;
+                }
+                else cp = 0xFFFD;
+            }
+            else if (cp >= 0xDC00 && cp < 0xE000) cp = 0xFFFD;
+        }
+        break;
+    default: // \" \\ \/
+        cp = s[1];
+        break;
+    }
+
+    *utf8len = encodeUtf8( cp, utf8 );
+
+    return consumed;
+}
+
+
+// Iterates over the unescaped UTF-8 bytes of a JSON string
+struct JsonStringReader {
+    const uint8_t* s;
+    const uint8_t* end;
+    uint8_t pending[4];
+    uint32_t pendingIdx;
+    uint32_t pendingLen;
+};
+
+
+static inline int nextStringByte( JsonStringReader& r )
+{
+    while (r.pendingIdx >= r.pendingLen)
+    {
+        if (r.s >= r.end) return -1;
+        if (*r.s != '\\') return *r.s++;
+        r.s += decodeEscape( r.s, r.end, r.pending, &r.pendingLen );
+        r.pendingIdx = 0;
+    }
+
+    return r.pending[r.pendingIdx++];
+}
+
+
+static int compareKeys( const uint8_t* a, const uint8_t* aend, const uint8_t* b, const uint8_t* bend )
+{
+    uint64_t alen = aend-a, blen = bend-b;
+
+    if (memchr( a, '\\', alen ) == nullptr && memchr( b, '\\', blen ) == nullptr)
+    {
+        int c = memcmp( a, b, alen < blen ? alen : blen );
+        if (c != 0) return c;
+        return alen < blen ? -1 : (alen > blen ? 1 : 0);
+    }
+
+    JsonStringReader ra = { a, aend, {}, 0, 0 };
+    JsonStringReader rb = { b, bend, {}, 0, 0 };
+
+    for (;;)
+    {
+        int ca = nextStringByte( ra );
+        int cb = nextStringByte( rb );
+        if (ca != cb || ca < 0) return ca - cb;
+    }
+}
+
+
+// Writes the canonical form of the number text [s, end) to out, which must hold end-s+32 bytes. Returns its length.
+static uint64_t canonicalNumber( const uint8_t* s, const uint8_t* end, uint8_t* out )
+{
+    const uint8_t* digits;
+    uint8_t* o = out;
+    bool negative = false;
+    int64_t fractionDigits = 0, exponent = 0;
+    uint64_t k = 0;
+
+    if (s < end && *s == '-') { negative = true; s++; }
+
+    // The significant digits are gathered in out past the room needed for the sign and leading "0.00000"
+    uint8_t* d = out + 8;
+    bool fraction = false;
+
+    while (s < end && ((*s >= '0' && *s <= '9') || (*s == '.' && !fraction)))
+    {
+        if (*s == '.') fraction = true;
+        else
+        {
+            if (k > 0 || *s != '0') d[k++] = *s;
+            if (fraction) fractionDigits++;
+        }
+        s++;
+    }
+
+    if (s < end && (*s == 'e' || *s == 'E'))
+    {
+        bool negativeExponent = false;
+        s++;
+        if (s < end && (*s == '+' || *s == '-')) negativeExponent = *s++ == '-';
+        while (s < end && *s >= '0' && *s <= '9')
+        {
+            if (exponent < 1000000000000000LL) exponent = exponent*10 + (*s - '0');
+            s++;
+        }
+        if (negativeExponent) exponent = -exponent;
+    }
+
+    while (k > 0 && d[k-1] == '0') { k--; exponent++; }
+
+    if (k == 0)
+    {
+        out[0] = '0';
+        return 1;
+    }
+
+    // The value is d * 10^x, n is the position of the decimal point relative to the first digit
+    int64_t x = exponent - fractionDigits;
+    int64_t n = (int64_t) k + x;
+    digits = d;
+
+    if (negative) *o++ = '-';
+
+    if ((int64_t) k <= n && n <= 21)
+    {
+        memmove( o, digits, k );
+        o += k;
+        for (int64_t z=k; z<n; z++) *o++ = '0';
+    }
+    else if (0 < n && n <= 21)
+    {
+        memmove( o, digits, n );
+        o += n;
+        *o++ = '.';
+        memmove( o, digits+n, k-n );
+        o += k-n;
+    }
+    else if (-6 < n && n <= 0)
+    {
+        *o++ = '0';
+        *o++ = '.';
+        for (int64_t z=n; z<0; z++) *o++ = '0';
+        memmove( o, digits, k );
+        o += k;
+    }
+    else
+    {
+        *o++ = digits[0];
+        if (k > 1)
+        {
+            *o++ = '.';
+            memmove( o, digits+1, k-1 );
+            o += k-1;
+        }
+        *o++ = 'e';
+        int64_t e = n-1;
+        *o++ = e < 0 ? '-' : '+';
+        if (e < 0) e = -e;
+        uint8_t tmp[24];
+        uint32_t t = 0;
+        do { tmp[t++] = '0' + (e % 10); e /= 10; } while (e > 0);
+        while (t > 0) *o++ = tmp[--t];
+    }
+
+    return o - out;
+}
+
+
+static inline void canonicalByte( uint8_t* out, uint64_t &j, uint8_t c )
+{
+    static const char hex[] = "0123456789abcdef";
+
+    if (c >= 0x20 && c != '"' && c != '\\')
+    {
+        out[j++] = c;
+        return;
+    }
+
+    out[j++] = '\\';
+
+    switch (c)
+    {
+    case '"': out[j++] = '"'; break;
+    case '\\': out[j++] = '\\'; break;
+    case 0x08: out[j++] = 'b'; break;
+    case 0x0C: out[j++] = 'f'; break;
+    case 0x0A: out[j++] = 'n'; break;
+    case 0x0D: out[j++] = 'r'; break;
+    case 0x09: out[j++] = 't'; break;
+    default:
+        out[j++] = 'u';
+        out[j++] = '0';
+        out[j++] = '0';
+        out[j++] = hex[c >> 4];
+        out[j++] = hex[c & 0xF];
+        break;
+    }
+}
+
+
+// Needs room for 6 output bytes per input byte plus the quotes
+static void canonicalString( uint8_t* out, uint64_t &j, const uint8_t* s, const uint8_t* end )
+{
+    out[j++] = '"';
+
+    while (s < end)
+    {
+        if (*s == '\\')
+        {
+            uint8_t utf8[4];
+            uint32_t n;
+            s += decodeEscape( s, end, utf8, &n );
+            for (uint32_t k=0; k<n; k++) canonicalByte( out, j, utf8[k] );
+        }
+        else canonicalByte( out, j, *s++ );
+    }
+
+    out[j++] = '"';
+}
+
+
+static bool reserveOutput( struct JsonContext* ctx, uint64_t n )
+{
+    if (ctx->jsonout != nullptr && ctx->jsonoutIdx + n <= ctx->jsonoutMax) return true;
+
+    uint64_t newMax = 2*ctx->jsonoutMax + n;
+    if (newMax < 65536) newMax = 65536;
+
+    uint8_t* out = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, newMax );
+    if (out == nullptr) return false;
+
+    if (ctx->jsonout)
+    {
+        memcpy( out, ctx->jsonout, ctx->jsonoutIdx );
+        align_free( ctx->jsonout );
+    }
+
+    ctx->jsonout = out;
+    ctx->jsonoutMax = newMax;
+
+    return true;
+}
+
+
+// scratch holds the sorted members of the objects being written, from the root down to i
+template <typename T>
+static bool canonicalRec( struct JsonContext* ctx, const T* dom, T i, T* scratch, T top )
+{
+    const uint8_t* buffer = ctx->jsonbuffer;
+    const uint64_t* keys = ctx->keys;
+    uint64_t ks, ke;
+    T ci, base;
+
+    if (i == TURBOJSON_NIL(T)) return true;
+
+    switch (dom[i])
+    {
+    case TURBOJSON_DOM_STRING:
+        if (!reserveOutput( ctx, 6*(uint64_t) (dom[i+2]-dom[i+1]) + 2 )) return false;
+        canonicalString( ctx->jsonout, ctx->jsonoutIdx, buffer+dom[i+1], buffer+dom[i+2] );
+        break;
+    case TURBOJSON_DOM_REAL:
+        if (!reserveOutput( ctx, dom[i+2]-dom[i+1] + 32 )) return false;
+        ctx->jsonoutIdx += canonicalNumber( buffer+dom[i+1], buffer+dom[i+2], ctx->jsonout+ctx->jsonoutIdx );
+        break;
+    case TURBOJSON_DOM_LITERAL:
+        if (!reserveOutput( ctx, dom[i+2]-dom[i+1] )) return false;
+        memcpy( ctx->jsonout+ctx->jsonoutIdx, buffer+dom[i+1], dom[i+2]-dom[i+1] );
+        ctx->jsonoutIdx += dom[i+2]-dom[i+1];
+        break;
+    case TURBOJSON_DOM_OBJECT:
+        base = top;
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = memberNext( dom, ci )) scratch[top++] = ci;
+        std::sort( scratch+base, scratch+top, [buffer, dom, keys]( T a, T b ) {
+            uint64_t as, ae, bs, be;
+            memberKey( dom, keys, a, &as, &ae );
+            memberKey( dom, keys, b, &bs, &be );
+            int c = compareKeys( buffer+as, buffer+ae, buffer+bs, buffer+be );
+            return c < 0 || (c == 0 && a < b);
+        } );
+        if (!reserveOutput( ctx, 1 )) return false;
+        ctx->jsonout[ctx->jsonoutIdx++] = '{';
+        for (T k=base; k<top; k++)
+        {
+            ci = scratch[k];
+            memberKey( dom, keys, ci, &ks, &ke );
+            if (!reserveOutput( ctx, 6*(ke-ks) + 4 )) return false;
+            if (k > base) ctx->jsonout[ctx->jsonoutIdx++] = ',';
+            canonicalString( ctx->jsonout, ctx->jsonoutIdx, buffer+ks, buffer+ke );
+            ctx->jsonout[ctx->jsonoutIdx++] = ':';
+            if (!canonicalRec( ctx, dom, memberValue( dom, ci ), scratch, top )) return false;
+        }
+        if (!reserveOutput( ctx, 1 )) return false;
+        ctx->jsonout[ctx->jsonoutIdx++] = '}';
+        break;
+    case TURBOJSON_DOM_ARRAY:
+        if (!reserveOutput( ctx, 1 )) return false;
+        ctx->jsonout[ctx->jsonoutIdx++] = '[';
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = dom[ci+2])
+        {
+            if (ci != dom[i+1])
+            {
+                if (!reserveOutput( ctx, 1 )) return false;
+                ctx->jsonout[ctx->jsonoutIdx++] = ',';
+            }
+            if (!canonicalRec( ctx, dom, dom[ci+1], scratch, top )) return false;
+        }
+        if (!reserveOutput( ctx, 1 )) return false;
+        ctx->jsonout[ctx->jsonoutIdx++] = ']';
+        break;
+    default:
+        break;
+    }
+
+    return true;
+}
+
+
+template <typename T>
+static void canonicalTape( struct JsonContext* ctx, const T* dom )
+{
+    // At most one member every 4 tape entries
+    T* scratch = (T*) align_alloc( MAX_CACHE_LINE_SIZE, (ctx->domIdx/4 + 1)*sizeof(T) );
+
+    if (scratch == nullptr) return;
+
+    if (reserveOutput( ctx, ctx->jsonbufferSize + 64 ))
+    {
+        if (!canonicalRec( ctx, dom, (T) 0, scratch, (T) 0 )) ctx->jsonoutIdx = 0;
+    }
+
+    align_free( scratch );
+}
+
+
+extern "C" void turbojson_canonical( struct JsonContext* ctx )
+{
+    ctx->jsonoutIdx = 0;
+
+    if (ctx->domIdx == 0) return;
+
+    if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+        canonicalTape( ctx, ctx->dom64 );
+    else
+        canonicalTape( ctx, ctx->dom );
+}
+
+
+#define TURBOJSON_HASH_P1 0x9E3779B97F4A7C15ULL
+#define TURBOJSON_HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define TURBOJSON_HASH_P3 0x165667B19E3779F9ULL
+#define TURBOJSON_HASH_P4 0x85EBCA77C2B2AE63ULL
+
+
+struct JsonHash {
+    uint64_t h0;
+    uint64_t h1;
+};
+
+
+// Byte strings are hashed 8 bytes at a time
+struct JsonHashStream {
+    JsonHash h;
+    uint64_t word;
+    uint32_t fill;
+    uint64_t len;
+};
+
+
+static inline uint64_t hashRotl( uint64_t x, int r )
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t hashAvalanche( uint64_t x )
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+
+static inline void hashInit( JsonHash& h, uint64_t type )
+{
+    h.h0 = TURBOJSON_HASH_P1 ^ type;
+    h.h1 = TURBOJSON_HASH_P2 + type;
+}
+
+
+static inline void hashWord( JsonHash& h, uint64_t w )
+{
+    h.h0 = hashRotl( h.h0 ^ (w * TURBOJSON_HASH_P2), 31 ) * TURBOJSON_HASH_P1;
+    h.h1 = hashRotl( h.h1 ^ (w * TURBOJSON_HASH_P3), 27 ) * TURBOJSON_HASH_P4 + h.h0;
+}
+
+
+static inline void hashFinish( JsonHash& h, uint64_t len )
+{
+    uint64_t a = hashAvalanche( h.h0 ^ len );
+    h.h1 = hashAvalanche( h.h1 + a );
+    h.h0 = a;
+}
+
+
+static inline void hashStreamInit( JsonHashStream& st, uint64_t type )
+{
+    hashInit( st.h, type );
+    st.word = 0;
+    st.fill = 0;
+    st.len = 0;
+}
+
+
+static void hashBytes( JsonHashStream& st, const uint8_t* p, uint64_t n )
+{
+    st.len += n;
+
+    while (n > 0)
+    {
+        if (st.fill == 0 && n >= 8)
+        {
+            uint64_t w;
+            memcpy( &w, p, 8 );
+            hashWord( st.h, w );
+            p += 8;
+            n -= 8;
+            continue;
+        }
+
+        st.word |= (uint64_t) *p++ << (8*st.fill);
+        n--;
+
+        if (++st.fill == 8)
+        {
+            hashWord( st.h, st.word );
+            st.word = 0;
+            st.fill = 0;
+        }
+    }
+}
+
+
+static inline JsonHash hashStreamFinish( JsonHashStream& st )
+{
+    if (st.fill) hashWord( st.h, st.word );
+    hashFinish( st.h, st.len );
+    return st.h;
+}
+
+
+static JsonHash hashString( uint64_t type, const uint8_t* s, const uint8_t* end )
+{
+    JsonHashStream st;
+    hashStreamInit( st, type );
+
+    while (s < end)
+    {
+        const uint8_t* e = (const uint8_t*) memchr( s, '\\', end-s );
+        if (e == nullptr) e = end;
+
+        hashBytes( st, s, e-s );
+        s = e;
+
+        if (s < end)
+        {
+            uint8_t utf8[4];
+            uint32_t n;
+            s += decodeEscape( s, end, utf8, &n );
+            hashBytes( st, utf8, n );
+        }
+    }
+
+    return hashStreamFinish( st );
+}
+
+
+static JsonHash hashNumber( const uint8_t* s, const uint8_t* end )
+{
+    uint8_t local[256];
+    uint8_t* number = local;
+    JsonHashStream st;
+
+    if (end-s+32 > (int64_t) sizeof(local)) number = (uint8_t*) malloc( end-s+32 );
+
+    hashStreamInit( st, 'n' );
+    if (number != nullptr) hashBytes( st, number, canonicalNumber( s, end, number ) );
+    if (number != local) free( number );
+
+    return hashStreamFinish( st );
+}
+
+
+// Members are combined with a sum so that the hash of an object doesn't depend on their order
+template <typename T>
+static JsonHash hashRec( const uint8_t* buffer, const T* dom, const uint64_t* keys, T i )
+{
+    JsonHash h, k, v, m;
+    uint64_t ks, ke;
+    uint64_t count = 0;
+    uint64_t acc0 = 0, acc1 = 0;
+    T ci;
+
+    if (i == TURBOJSON_NIL(T))
+    {
+        hashInit( h, 'z' );
+        hashFinish( h, 0 );
+        return h;
+    }
+
+    switch (dom[i])
+    {
+    case TURBOJSON_DOM_STRING:
+        return hashString( 's', buffer+dom[i+1], buffer+dom[i+2] );
+    case TURBOJSON_DOM_REAL:
+        return hashNumber( buffer+dom[i+1], buffer+dom[i+2] );
+    case TURBOJSON_DOM_LITERAL:
+        return hashString( 'l', buffer+dom[i+1], buffer+dom[i+2] );
+    case TURBOJSON_DOM_OBJECT:
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = memberNext( dom, ci ))
+        {
+            memberKey( dom, keys, ci, &ks, &ke );
+            k = hashString( 'k', buffer+ks, buffer+ke );
+            v = hashRec( buffer, dom, keys, memberValue( dom, ci ) );
+            hashInit( m, 'm' );
+            hashWord( m, k.h0 );
+            hashWord( m, k.h1 );
+            hashWord( m, v.h0 );
+            hashWord( m, v.h1 );
+            hashFinish( m, 2 );
+            acc0 += m.h0;
+            acc1 += m.h1;
+            count++;
+        }
+        hashInit( h, 'o' );
+        hashWord( h, acc0 );
+        hashWord( h, acc1 );
+        hashFinish( h, count );
+        return h;
+    case TURBOJSON_DOM_ARRAY:
+        hashInit( h, 'a' );
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = dom[ci+2])
+        {
+            v = hashRec( buffer, dom, keys, dom[ci+1] );
+            hashWord( h, v.h0 );
+            hashWord( h, v.h1 );
+            count++;
+        }
+        hashFinish( h, count );
+        return h;
+    case TURBOJSON_DOM_MEMBER:
+    case TURBOJSON_DOM_MEMBER_KEY:
+        return hashRec( buffer, dom, keys, memberValue( dom, i ) );
+    case TURBOJSON_DOM_ARRAY_ELEMENT:
+        return hashRec( buffer, dom, keys, dom[i+1] );
+    default:
+        return hashRec( buffer, dom, keys, TURBOJSON_NIL(T) );
+    }
+}
+
+
+extern "C" void turbojson_hash128( const struct JsonContext* ctx, uint64_t idx, uint64_t hash[2] )
+{
+    JsonHash h;
+
+    if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+        h = hashRec( ctx->jsonbuffer, ctx->dom64, ctx->keys, idx < ctx->domIdx ? idx : TURBOJSON_NIL(uint64_t) );
+    else
+        h = hashRec( ctx->jsonbuffer, ctx->dom, ctx->keys, idx < ctx->domIdx ? (uint32_t) idx : TURBOJSON_NIL(uint32_t) );
+
+    hash[0] = h.h0;
+    hash[1] = h.h1;
+}
+
+
+extern "C" uint64_t turbojson_hash( const struct JsonContext* ctx, uint64_t idx )
+{
+    uint64_t hash[2];
+
+    turbojson_hash128( ctx, idx, hash );
+
+    return hash[0];
+}
+
+
+/*
+Binary formats. The writers walk the tape once, container lengths are counted from the member
+and element lists before the header is written. Integers are written in the smallest integer
+encoding that holds them, other numbers as 64-bit floats and strings are unescaped to UTF-8.
+
+The readers rebuild a minified JSON text in jsonbuffer while they fill the tape, so that the
+tape has the same layout as after turbojson_parsebuffer. Doubles are printed by doubleToText,
+with the fewest digits that read back exactly, and keep a fraction or an exponent. Integers
+stay integers.
+Both directions recurse once per nesting level and fail past TURBOJSON_BINARY_MAX_DEPTH levels.
+*/
+
+#define TURBOJSON_FORMAT_MSGPACK 0
+#define TURBOJSON_FORMAT_CBOR 1
+
+#define TURBOJSON_BINARY_UINT 1
+#define TURBOJSON_BINARY_NINT 2 // The value is -1 - n
+#define TURBOJSON_BINARY_DOUBLE 3
+#define TURBOJSON_BINARY_STRING 4
+#define TURBOJSON_BINARY_ARRAY 5
+#define TURBOJSON_BINARY_MAP 6
+#define TURBOJSON_BINARY_TRUE 7
+#define TURBOJSON_BINARY_FALSE 8
+#define TURBOJSON_BINARY_NULL 9
+
+// Deeper input is rejected, one byte per level would otherwise be enough to overflow the stack
+#define TURBOJSON_BINARY_MAX_DEPTH 1024
+
+// CBOR major types
+#define TURBOJSON_CBOR_UINT 0
+#define TURBOJSON_CBOR_NINT 1
+#define TURBOJSON_CBOR_BYTES 2
+#define TURBOJSON_CBOR_TEXT 3
+#define TURBOJSON_CBOR_ARRAY 4
+#define TURBOJSON_CBOR_MAP 5
+#define TURBOJSON_CBOR_TAG 6
+#define TURBOJSON_CBOR_SIMPLE 7
+
+
+static inline void storeBigEndian( uint8_t* out, uint64_t &j, uint64_t v, uint32_t n )
+{
+    for (uint32_t k=0; k<n; k++) out[j+k] = (uint8_t) (v >> (8*(n-1-k)));
+    j += n;
+}
+
+
+static inline uint64_t loadBigEndian( const uint8_t* p, uint32_t n )
+{
+    uint64_t v = 0;
+    for (uint32_t k=0; k<n; k++) v = (v << 8) | p[k];
+    return v;
+}
+
+
+// Writes a CBOR head, at most 9 bytes
+static inline void cborHead( uint8_t* out, uint64_t &j, uint32_t major, uint64_t n )
+{
+    uint8_t m = (uint8_t) (major << 5);
+
+    if (n < 24) out[j++] = m | (uint8_t) n;
+    else if (n <= 0xFF) { out[j++] = m | 24; storeBigEndian( out, j, n, 1 ); }
+    else if (n <= 0xFFFF) { out[j++] = m | 25; storeBigEndian( out, j, n, 2 ); }
+    else if (n <= 0xFFFFFFFF) { out[j++] = m | 26; storeBigEndian( out, j, n, 4 ); }
+    else { out[j++] = m | 27; storeBigEndian( out, j, n, 8 ); }
+}
+
+
+// Writes a MessagePack string, array or map header, at most 5 bytes
+static inline bool msgpackHead( uint8_t* out, uint64_t &j, uint32_t kind, uint64_t n )
+{
+    if (n > 0xFFFFFFFF) return false;
+
+    if (kind == TURBOJSON_BINARY_STRING)
+    {
+        if (n < 32) out[j++] = 0xA0 | (uint8_t) n;
+        else if (n <= 0xFF) { out[j++] = 0xD9; storeBigEndian( out, j, n, 1 ); }
+        else if (n <= 0xFFFF) { out[j++] = 0xDA; storeBigEndian( out, j, n, 2 ); }
+        else { out[j++] = 0xDB; storeBigEndian( out, j, n, 4 ); }
+    }
+    else
+    {
+        bool map = kind == TURBOJSON_BINARY_MAP;
+
+        if (n < 16) out[j++] = (map ? 0x80 : 0x90) | (uint8_t) n;
+        else if (n <= 0xFFFF) { out[j++] = map ? 0xDE : 0xDC; storeBigEndian( out, j, n, 2 ); }
+        else { out[j++] = map ? 0xDF : 0xDD; storeBigEndian( out, j, n, 4 ); }
+    }
+
+    return true;
+}
+
+
+static bool binaryHead( uint8_t* out, uint64_t &j, uint32_t format, uint32_t kind, uint64_t n )
+{
+    if (format == TURBOJSON_FORMAT_MSGPACK) return msgpackHead( out, j, kind, n );
+
+    cborHead( out, j, kind == TURBOJSON_BINARY_STRING ? TURBOJSON_CBOR_TEXT : (kind == TURBOJSON_BINARY_MAP ? TURBOJSON_CBOR_MAP : TURBOJSON_CBOR_ARRAY), n );
+
+    return true;
+}
+
+
+// Writes the unescaped JSON string [s, end), the output needs 2*(end-s)+9 bytes for malformed escapes
+static bool binaryString( uint8_t* out, uint64_t &j, uint32_t format, const uint8_t* s, const uint8_t* end )
+{
+    uint64_t len = end-s;
+
+    if (memchr( s, '\\', len ) == nullptr)
+    {
+        if (!binaryHead( out, j, format, TURBOJSON_BINARY_STRING, len )) return false;
+        memcpy( out+j, s, len );
+        j += len;
+        return true;
+    }
+
+    // Unescaped after the largest head, then moved back once the length is known
+    uint8_t* text = out+j+9;
+    uint64_t n = 0;
+
+    while (s < end)
+    {
+        if (*s == '\\')
+        {
+            uint32_t u;
+            s += decodeEscape( s, end, text+n, &u );
+            n += u;
+        }
+        else text[n++] = *s++;
+    }
+
+    if (!binaryHead( out, j, format, TURBOJSON_BINARY_STRING, n )) return false;
+    memmove( out+j, text, n );
+    j += n;
+
+    return true;
+}
+
+
+// Writes the number text [s, end), at most 9 bytes
+static void binaryNumber( uint8_t* out, uint64_t &j, uint32_t format, const uint8_t* s, const uint8_t* end )
+{
+    const uint8_t* p = s;
+    bool negative = p < end && *p == '-';
+    uint64_t v = 0;
+    bool integer = true;
+
+    if (negative) p++;
+    if (p == end) integer = false;
+
+    for (; p < end && integer; p++)
+    {
+        if (*p < '0' || *p > '9' || v > (0xFFFFFFFFFFFFFFFFULL - (*p - '0')) / 10) integer = false;
+        else v = v*10 + (*p - '0');
+    }
+
+    // Negative values are stored as -1 - v, as in CBOR
+    if (integer && negative)
+    {
+        if (v == 0) negative = false;
+        else if (v - 1 > 0x7FFFFFFFFFFFFFFFULL) integer = false;
+        else v--;
+    }
+
+    if (!integer)
+    {
+        double d = numberToDouble( s, end );
+        uint64_t bits;
+        memcpy( &bits, &d, 8 );
+        out[j++] = format == TURBOJSON_FORMAT_MSGPACK ? 0xCB : 0xFB;
+        storeBigEndian( out, j, bits, 8 );
+    }
+    else if (format == TURBOJSON_FORMAT_CBOR) cborHead( out, j, negative ? TURBOJSON_CBOR_NINT : TURBOJSON_CBOR_UINT, v );
+    else if (!negative)
+    {
+        if (v < 0x80) out[j++] = (uint8_t) v;
+        else if (v <= 0xFF) { out[j++] = 0xCC; storeBigEndian( out, j, v, 1 ); }
+        else if (v <= 0xFFFF) { out[j++] = 0xCD; storeBigEndian( out, j, v, 2 ); }
+        else if (v <= 0xFFFFFFFF) { out[j++] = 0xCE; storeBigEndian( out, j, v, 4 ); }
+        else { out[j++] = 0xCF; storeBigEndian( out, j, v, 8 ); }
+    }
+    else
+    {
+        // v is -1 - value
+        if (v < 32) out[j++] = (uint8_t) (0xFF - v);
+        else if (v < 0x80) { out[j++] = 0xD0; storeBigEndian( out, j, ~v, 1 ); }
+        else if (v < 0x8000) { out[j++] = 0xD1; storeBigEndian( out, j, ~v, 2 ); }
+        else if (v < 0x80000000) { out[j++] = 0xD2; storeBigEndian( out, j, ~v, 4 ); }
+        else { out[j++] = 0xD3; storeBigEndian( out, j, ~v, 8 ); }
+    }
+}
+
+
+template <typename T>
+static bool binaryRec( struct JsonContext* ctx, const T* dom, T i, uint32_t format, uint32_t depth )
+{
+    const uint8_t* buffer = ctx->jsonbuffer;
+    uint64_t n, ks, ke;
+    T ci;
+
+    if (i == TURBOJSON_NIL(T))
+    {
+        if (!reserveOutput( ctx, 1 )) return false;
+        ctx->jsonout[ctx->jsonoutIdx++] = format == TURBOJSON_FORMAT_MSGPACK ? 0xC0 : 0xF6;
+        return true;
+    }
+
+    if ((dom[i] == TURBOJSON_DOM_OBJECT || dom[i] == TURBOJSON_DOM_ARRAY) && depth >= TURBOJSON_BINARY_MAX_DEPTH) return false;
+
+    switch (dom[i])
+    {
+    case TURBOJSON_DOM_STRING:
+        if (!reserveOutput( ctx, 2*(dom[i+2]-dom[i+1])+9 )) return false;
+        return binaryString( ctx->jsonout, ctx->jsonoutIdx, format, buffer+dom[i+1], buffer+dom[i+2] );
+    case TURBOJSON_DOM_REAL:
+        if (!reserveOutput( ctx, 9 )) return false;
+        binaryNumber( ctx->jsonout, ctx->jsonoutIdx, format, buffer+dom[i+1], buffer+dom[i+2] );
+        break;
+    case TURBOJSON_DOM_LITERAL:
+        if (!reserveOutput( ctx, 1 )) return false;
+        if (buffer[dom[i+1]] == 't') ctx->jsonout[ctx->jsonoutIdx++] = format == TURBOJSON_FORMAT_MSGPACK ? 0xC3 : 0xF5;
+        else if (buffer[dom[i+1]] == 'f') ctx->jsonout[ctx->jsonoutIdx++] = format == TURBOJSON_FORMAT_MSGPACK ? 0xC2 : 0xF4;
+        else ctx->jsonout[ctx->jsonoutIdx++] = format == TURBOJSON_FORMAT_MSGPACK ? 0xC0 : 0xF6;
+        break;
+    case TURBOJSON_DOM_OBJECT:
+        n = 0;
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = memberNext( dom, ci )) n++;
+        if (!reserveOutput( ctx, 9 ) || !binaryHead( ctx->jsonout, ctx->jsonoutIdx, format, TURBOJSON_BINARY_MAP, n )) return false;
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = memberNext( dom, ci ))
+        {
+            memberKey( dom, (const uint64_t*) ctx->keys, ci, &ks, &ke );
+            if (!reserveOutput( ctx, 2*(ke-ks)+9 )) return false;
+            if (!binaryString( ctx->jsonout, ctx->jsonoutIdx, format, buffer+ks, buffer+ke )) return false;
+            if (!binaryRec( ctx, dom, memberValue( dom, ci ), format, depth+1 )) return false;
+        }
+        break;
+    case TURBOJSON_DOM_ARRAY:
+        n = 0;
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = dom[ci+2]) n++;
+        if (!reserveOutput( ctx, 9 ) || !binaryHead( ctx->jsonout, ctx->jsonoutIdx, format, TURBOJSON_BINARY_ARRAY, n )) return false;
+        for (ci = dom[i+1]; ci != TURBOJSON_NIL(T); ci = dom[ci+2])
+        {
+            if (!binaryRec( ctx, dom, dom[ci+1], format, depth+1 )) return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+
+static void binaryTape( struct JsonContext* ctx, uint32_t format )
+{
+    ctx->jsonoutIdx = 0;
+
+    if (ctx->domIdx == 0 || !reserveOutput( ctx, ctx->jsonbufferSize + 64 )) return;
+
+    bool ok;
+
+    if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+        ok = binaryRec( ctx, (const uint64_t*) ctx->dom64, (uint64_t) 0, format, 0 );
+    else
+        ok = binaryRec( ctx, (const uint32_t*) ctx->dom, (uint32_t) 0, format, 0 );
+
+    if (!ok) ctx->jsonoutIdx = 0;
+}
+
+
+extern "C" void turbojson_to_msgpack( struct JsonContext* ctx )
+{
+    binaryTape( ctx, TURBOJSON_FORMAT_MSGPACK );
+}
+
+
+extern "C" void turbojson_to_cbor( struct JsonContext* ctx )
+{
+    binaryTape( ctx, TURBOJSON_FORMAT_CBOR );
+}
+
+
+struct JsonBinaryReader {
+    const uint8_t* data;
+    uint64_t len;
+    uint64_t pos;
+    uint32_t format;
+};
+
+
+struct JsonBinaryItem {
+    uint32_t kind;
+    uint64_t n; // Value, length or count
+    double d;
+    const uint8_t* s;
+};
+
+
+static inline bool readBytes( JsonBinaryReader& r, uint32_t n, uint64_t* v )
+{
+    if (r.len - r.pos < n) return false;
+    *v = loadBigEndian( r.data + r.pos, n );
+    r.pos += n;
+    return true;
+}
+
+
+static inline double halfToDouble( uint32_t h )
+{
+    uint32_t e = (h >> 10) & 0x1F;
+    uint32_t m = h & 0x3FF;
+    double d;
+
+    if (e == 0) d = ldexp( (double) m, -24 );
+    else if (e == 31) d = m == 0 ? HUGE_VAL : NAN;
+    else d = ldexp( (double) (m + 1024), (int) e - 25 );
+
+    return (h & 0x8000) ? -d : d;
+}
+
+
+static inline double bitsToDouble( uint64_t bits, uint32_t n )
+{
+    if (n == 4)
+    {
+        float f;
+        uint32_t b = (uint32_t) bits;
+        memcpy( &f, &b, 4 );
+        return f;
+    }
+
+    double d;
+    memcpy( &d, &bits, 8 );
+    return d;
+}
+
+
+static bool readMsgpackItem( JsonBinaryReader& r, JsonBinaryItem& item )
+{
+    if (r.pos >= r.len) return false;
+
+    uint8_t c = r.data[r.pos++];
+    uint64_t v;
+
+    if (c < 0x80) { item.kind = TURBOJSON_BINARY_UINT; item.n = c; return true; }
+    if (c >= 0xE0) { item.kind = TURBOJSON_BINARY_NINT; item.n = 0xFF - c; return true; }
+    if ((c & 0xF0) == 0x80) { item.kind = TURBOJSON_BINARY_MAP; item.n = c & 0x0F; return true; }
+    if ((c & 0xF0) == 0x90) { item.kind = TURBOJSON_BINARY_ARRAY; item.n = c & 0x0F; return true; }
+
+    if ((c & 0xE0) == 0xA0)
+    {
+        item.n = c & 0x1F;
+        goto string;
+    }
+
+    switch (c)
+    {
+    case 0xC0: item.kind = TURBOJSON_BINARY_NULL; return true;
+    case 0xC2: item.kind = TURBOJSON_BINARY_FALSE; return true;
+    case 0xC3: item.kind = TURBOJSON_BINARY_TRUE; return true;
+    case 0xCA:
+    case 0xCB:
+        if (!readBytes( r, c == 0xCA ? 4 : 8, &v )) return false;
+        item.kind = TURBOJSON_BINARY_DOUBLE;
+        item.d = bitsToDouble( v, c == 0xCA ? 4 : 8 );
+        return true;
+    case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+        if (!readBytes( r, 1 << (c - 0xCC), &item.n )) return false;
+        item.kind = TURBOJSON_BINARY_UINT;
+        return true;
+    case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+    {
+        uint32_t n = 1 << (c - 0xD0);
+        if (!readBytes( r, n, &v )) return false;
+        // Sign extended, then stored as -1 - value when negative
+        int64_t s = n == 8 ? (int64_t) v : (int64_t) (v << (64 - 8*n)) >> (64 - 8*n);
+        item.kind = s < 0 ? TURBOJSON_BINARY_NINT : TURBOJSON_BINARY_UINT;
+        item.n = s < 0 ? ~(uint64_t) s : (uint64_t) s;
+        return true;
+    }
+    case 0xD9: case 0xDA: case 0xDB:
+        if (!readBytes( r, 1 << (c - 0xD9), &item.n )) return false;
+        goto string;
+    case 0xDC: case 0xDD:
+        if (!readBytes( r, c == 0xDC ? 2 : 4, &item.n )) return false;
+        item.kind = TURBOJSON_BINARY_ARRAY;
+        return true;
+    case 0xDE: case 0xDF:
+        if (!readBytes( r, c == 0xDE ? 2 : 4, &item.n )) return false;
+        item.kind = TURBOJSON_BINARY_MAP;
+        return true;
+    default:
+        // Binary, extension and reserved types have no JSON counterpart
+        return false;
+    }
+
+string:
+    if (r.len - r.pos < item.n) return false;
+    item.kind = TURBOJSON_BINARY_STRING;
+    item.s = r.data + r.pos;
+    r.pos += item.n;
+    return true;
+}
+
+
+static bool readCborItem( JsonBinaryReader& r, JsonBinaryItem& item )
+{
+    for (;;)
+    {
+        if (r.pos >= r.len) return false;
+
+        uint8_t c = r.data[r.pos++];
+        uint32_t major = c >> 5;
+        uint32_t info = c & 0x1F;
+        uint64_t n = info;
+
+        if (info >= 24 && info <= 27)
+        {
+            if (!readBytes( r, 1 << (info - 24), &n )) return false;
+        }
+        else if (info > 27) return false; // Indefinite lengths are not supported
+
+        switch (major)
+        {
+        case TURBOJSON_CBOR_UINT: item.kind = TURBOJSON_BINARY_UINT; item.n = n; return true;
+        case TURBOJSON_CBOR_NINT: item.kind = TURBOJSON_BINARY_NINT; item.n = n; return true;
+        case TURBOJSON_CBOR_TEXT:
+            if (r.len - r.pos < n) return false;
+            item.kind = TURBOJSON_BINARY_STRING;
+            item.n = n;
+            item.s = r.data + r.pos;
+            r.pos += n;
+            return true;
+        case TURBOJSON_CBOR_ARRAY: item.kind = TURBOJSON_BINARY_ARRAY; item.n = n; return true;
+        case TURBOJSON_CBOR_MAP: item.kind = TURBOJSON_BINARY_MAP; item.n = n; return true;
+        case TURBOJSON_CBOR_TAG: continue; // Tags are dropped, the tagged item is read
+        case TURBOJSON_CBOR_SIMPLE:
+            switch (info)
+            {
+            case 20: item.kind = TURBOJSON_BINARY_FALSE; return true;
+            case 21: item.kind = TURBOJSON_BINARY_TRUE; return true;
+            case 22: case 23: item.kind = TURBOJSON_BINARY_NULL; return true; // null and undefined
+            case 25: item.kind = TURBOJSON_BINARY_DOUBLE; item.d = halfToDouble( (uint32_t) n ); return true;
+            case 26: item.kind = TURBOJSON_BINARY_DOUBLE; item.d = bitsToDouble( n, 4 ); return true;
+            case 27: item.kind = TURBOJSON_BINARY_DOUBLE; item.d = bitsToDouble( n, 8 ); return true;
+            default: return false;
+            }
+        default: // Byte strings have no JSON counterpart
+            return false;
+        }
+    }
+}
+
+
+static inline bool readBinaryItem( JsonBinaryReader& r, JsonBinaryItem& item )
+{
+    return r.format == TURBOJSON_FORMAT_MSGPACK ? readMsgpackItem( r, item ) : readCborItem( r, item );
+}
+
+
+static bool reserveText( struct JsonContext* ctx, uint64_t n )
+{
+    if (ctx->jsonbuffer != nullptr && ctx->jsonbufferSize + n <= ctx->jsonbufferMax) return true;
+
+    uint64_t newMax = 2*ctx->jsonbufferMax + n;
+    if (newMax < 4096) newMax = 4096;
+
+    uint8_t* text = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, newMax );
+    if (text == nullptr) return false;
+
+    if (ctx->jsonbuffer)
+    {
+        memcpy( text, ctx->jsonbuffer, ctx->jsonbufferSize );
+        align_free( ctx->jsonbuffer );
+    }
+
+    ctx->jsonbuffer = text;
+    ctx->jsonbufferMax = newMax;
+
+    return true;
+}
+
+
+// Appends the text of a number, string key or scalar item to jsonbuffer
+static bool binaryText( struct JsonContext* ctx, const JsonBinaryItem& item )
+{
+    uint8_t* text;
+    uint64_t j;
+
+    if (item.kind == TURBOJSON_BINARY_STRING)
+    {
+        if (!reserveText( ctx, 6*item.n + 2 )) return false;
+        text = ctx->jsonbuffer;
+        j = ctx->jsonbufferSize;
+        text[j++] = '"';
+        for (uint64_t k=0; k<item.n; k++) canonicalByte( text, j, item.s[k] );
+        text[j++] = '"';
+        ctx->jsonbufferSize = j;
+        return true;
+    }
+
+    if (!reserveText( ctx, 32 )) return false;
+    text = ctx->jsonbuffer + ctx->jsonbufferSize;
+
+    switch (item.kind)
+    {
+    case TURBOJSON_BINARY_UINT:
+        j = uint64ToText( text, item.n );
+        break;
+    case TURBOJSON_BINARY_NINT:
+        text[0] = '-';
+        if (item.n == 0xFFFFFFFFFFFFFFFFULL)
+        {
+            memcpy( text+1, "18446744073709551616", 20 );
+            j = 21;
+        }
+        else j = 1 + uint64ToText( text+1, item.n + 1 );
+        break;
+    case TURBOJSON_BINARY_DOUBLE:
+        if (item.d != item.d || item.d - item.d != 0)
+        {
+            // NaN and infinities have no JSON form
+            memcpy( text, "null", 4 );
+            j = 4;
+            break;
+        }
+        j = doubleToText( text, item.d );
+        // Keep the number a floating point value when read back
+        if (memchr( text, '.', j ) == nullptr && memchr( text, 'e', j ) == nullptr)
+        {
+            memcpy( text+j, ".0", 2 );
+            j += 2;
+        }
+        break;
+    case TURBOJSON_BINARY_TRUE:
+        memcpy( text, "true", 4 );
+        j = 4;
+        break;
+    case TURBOJSON_BINARY_FALSE:
+        memcpy( text, "false", 5 );
+        j = 5;
+        break;
+    default:
+        memcpy( text, "null", 4 );
+        j = 4;
+        break;
+    }
 
+    ctx->jsonbufferSize += j;
 
-#define turbojson_memcpy8( A, B ) *((uint64_t*) (A)) = *((const uint64_t*) (B))
+    return true;
+}
 
 
-static void turbojson_memcpy( uint8_t* dst, const uint8_t* src, const uint8_t* srcend )
+template <typename T>
+static T binaryValue( struct JsonContext* ctx, JsonTape<T>& tape, JsonBinaryReader& r, uint32_t depth )
 {
-    do {
-        turbojson_memcpy8( dst, src );
-        src += 8;
-        dst += 8;
-    } while (src < srcend) ;
-}
+    JsonBinaryItem item;
+    T oIdx = tape.domIdx;
 
+    if (!readBinaryItem( r, item ) || !reserveTape( tape, (T) 4 )) return TURBOJSON_NIL(T);
 
-extern "C" void turbojson_parsefile( struct JsonContext* ctx, const char* jsonfilename )
-{
-    FILE* in = fopen( jsonfilename, "rb" );
+    T* dom = tape.dom;
+    uint64_t start = ctx->jsonbufferSize;
 
-    if (in)
+    if (item.kind != TURBOJSON_BINARY_ARRAY && item.kind != TURBOJSON_BINARY_MAP)
     {
-        fseek( in, 0, SEEK_END );
-        size_t filesize = ftell( in );
-        fseek( in, 0, SEEK_SET );
+        if (!binaryText( ctx, item )) return TURBOJSON_NIL(T);
 
-        if (filesize > 0)
+        tape.domIdx += 3;
+
+        if (item.kind == TURBOJSON_BINARY_STRING)
         {
-            size_t allocfilesize = filesize + (filesize/2);
-            uint8_t* buffer = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, allocfilesize );
+            dom[oIdx] = TURBOJSON_DOM_STRING;
+            dom[oIdx+1] = (T) start+1;
+            dom[oIdx+2] = (T) ctx->jsonbufferSize-1;
+        }
+        else
+        {
+            bool literal = item.kind >= TURBOJSON_BINARY_TRUE || (item.kind == TURBOJSON_BINARY_DOUBLE && ctx->jsonbuffer[start] == 'n');
+            dom[oIdx] = literal ? TURBOJSON_DOM_LITERAL : TURBOJSON_DOM_REAL;
+            dom[oIdx+1] = (T) start;
+            dom[oIdx+2] = (T) ctx->jsonbufferSize;
+        }
 
-            if (buffer != nullptr)
+        return oIdx;
+    }
+
+    if (depth >= TURBOJSON_BINARY_MAX_DEPTH) return TURBOJSON_NIL(T);
+
+    bool map = item.kind == TURBOJSON_BINARY_MAP;
+    T prevIdx = TURBOJSON_NIL(T);
+
+    tape.domIdx += 4;
+    dom[oIdx] = map ? TURBOJSON_DOM_OBJECT : TURBOJSON_DOM_ARRAY;
+    dom[oIdx+1] = TURBOJSON_NIL(T);
+    dom[oIdx+2] = (T) start;
+
+    if (!reserveText( ctx, 1 )) return TURBOJSON_NIL(T);
+    ctx->jsonbuffer[ctx->jsonbufferSize++] = map ? '{' : '[';
+
+    // Every item takes at least one byte, so a bogus count ends with the input
+    for (uint64_t k=0; k<item.n; k++)
+    {
+        T memberIdx = tape.domIdx;
+        T valueIdx;
+
+        if (!reserveText( ctx, 1 ) || !reserveTape( tape, (T) 5 )) return TURBOJSON_NIL(T);
+        if (k) ctx->jsonbuffer[ctx->jsonbufferSize++] = ',';
+
+        if (map)
+        {
+            JsonBinaryItem key;
+
+            if (!readBinaryItem( r, key )) return TURBOJSON_NIL(T);
+            if (key.kind != TURBOJSON_BINARY_STRING && key.kind != TURBOJSON_BINARY_UINT && key.kind != TURBOJSON_BINARY_NINT) return TURBOJSON_NIL(T);
+
+            // Integer keys become their decimal string
+            bool quote = key.kind != TURBOJSON_BINARY_STRING;
+            if (quote) { if (!reserveText( ctx, 1 )) return TURBOJSON_NIL(T); ctx->jsonbuffer[ctx->jsonbufferSize++] = '"'; }
+            uint64_t keyStart = ctx->jsonbufferSize + (quote ? 0 : 1);
+            if (!binaryText( ctx, key )) return TURBOJSON_NIL(T);
+            uint64_t keyEnd = ctx->jsonbufferSize - (quote ? 0 : 1);
+            if (!reserveText( ctx, 2 )) return TURBOJSON_NIL(T);
+            if (quote) ctx->jsonbuffer[ctx->jsonbufferSize++] = '"';
+            ctx->jsonbuffer[ctx->jsonbufferSize++] = ':';
+
+            if (tape.keys)
             {
-                size_t readsize = fread( buffer, 1, filesize, in );
+                uint32_t id = internKey( tape.keys, keyStart, keyEnd );
+                if (id == 0xFFFFFFFF) return TURBOJSON_NIL(T);
 
-                if (readsize == filesize)
-                {
-                    turbojson_parsebuffer( ctx, buffer, filesize, allocfilesize );
-                }
+                tape.domIdx += 4;
+                tape.dom[memberIdx] = TURBOJSON_DOM_MEMBER_KEY;
+                tape.dom[memberIdx+1] = id;
+                tape.dom[memberIdx+3] = TURBOJSON_NIL(T);
+            }
+            else
+            {
+                tape.domIdx += 5;
+                tape.dom[memberIdx] = TURBOJSON_DOM_MEMBER;
+                tape.dom[memberIdx+1] = (T) keyStart;
+                tape.dom[memberIdx+2] = (T) keyEnd;
+                tape.dom[memberIdx+4] = TURBOJSON_NIL(T);
             }
         }
+        else
+        {
+            tape.domIdx += 3;
+            tape.dom[memberIdx] = TURBOJSON_DOM_ARRAY_ELEMENT;
+            tape.dom[memberIdx+2] = TURBOJSON_NIL(T);
+        }
 
-        fclose( in );
+        valueIdx = binaryValue( ctx, tape, r, depth+1 );
+        if (valueIdx == TURBOJSON_NIL(T)) return TURBOJSON_NIL(T);
+
+        // The tape may have moved while reading the value
+        if (map) tape.dom[memberIdx + (tape.keys ? 2 : 3)] = valueIdx;
+        else tape.dom[memberIdx+1] = valueIdx;
+
+        if (prevIdx == TURBOJSON_NIL(T)) tape.dom[oIdx+1] = memberIdx;
+        else tape.dom[prevIdx + (!map ? 2 : (tape.keys ? 3 : 4))] = memberIdx;
+
+        prevIdx = memberIdx;
     }
+
+    if (!reserveText( ctx, 1 )) return TURBOJSON_NIL(T);
+    ctx->jsonbuffer[ctx->jsonbufferSize++] = map ? '}' : ']';
+    tape.dom[oIdx+3] = (T) ctx->jsonbufferSize | TURBOJSON_DOM_MINIFIED(T);
+
+    return oIdx;
 }
 
 
-static inline void skipSpaces( uint8_t* buffer, uint32_t *indice, uint32_t size )
+template <typename T>
+static void binaryParse( struct JsonContext* ctx, T** dom, JsonBinaryReader& r )
 {
-    uint32_t i = *indice;
-    while ((i < size) && (buffer[i] == ' ' || buffer[i] == '\t' || buffer[i] == '\n' || buffer[i] == '\r')) i++;
-    *indice = i;
-}
+    JsonTape<T> tape;
+
+    if (*dom == nullptr)
+    {
+        ctx->domSz = 2*r.len + 64;
+        *dom = (T*) align_alloc( MAX_CACHE_LINE_SIZE, ctx->domSz*sizeof(T) );
+        if (*dom == nullptr) return;
+    }
+
+    tape.dom = *dom;
+    tape.domIdx = 0;
+    tape.domSz = (T) ctx->domSz;
+    tape.overflow = false;
+    tape.spaces = 0;
+    tape.keys = nullptr;
+
+    if (ctx->flags & TURBOJSON_INTERN_KEYS)
+    {
+        if (!resetKeys( ctx )) return;
+        tape.keys = ctx;
+    }
 
+    T root = binaryValue( ctx, tape, r, 0 );
 
-static uint32_t parseChildElement( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz );
+    *dom = tape.dom;
+    ctx->domIdx = root == TURBOJSON_NIL(T) || r.pos != r.len ? 0 : tape.domIdx;
+    ctx->domSz = tape.domSz;
+}
 
 
-static uint32_t parseDouble( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz )
+static void binaryRead( struct JsonContext* ctx, const uint8_t* data, uint64_t len, uint32_t format )
 {
-    uint32_t i = *indice;
-    uint32_t j = *domIdx;
-    uint32_t dSz = *domSz;
-    uint32_t oIdx = j;
+    JsonBinaryReader r = { data, len, 0, format };
 
-    j += 3;
-    dom[oIdx] = TURBOJSON_DOM_REAL;
-    dom[oIdx+1] = i; // The indice of the real in UTF-8
+    ctx->domIdx = 0;
+    ctx->jsonbufferSize = 0;
 
-    while ((i < size) && ((buffer[i] >= '0' && buffer[i] <= '9') || (buffer[i] == '.') || (buffer[i] == '-'))) i++;
+    if (data == nullptr || len == 0 || !reserveText( ctx, 2*len + 64 )) return;
 
-    dom[oIdx+2] = i; // The indice of the end of the real string
+    // A byte of input gives at most 6 bytes of text, "null," or an escaped control character
+    selectTape( ctx, 6*len + 64 );
 
-    *indice = i;
-    *domIdx = j;
-    *domSz = dSz;
+    if (ctx->flags & TURBOJSON_LARGE_DOCUMENT)
+    {
+        if (ctx->dom)
+        {
+            align_free(ctx->dom);
+            ctx->dom = nullptr;
+        }
 
-    return oIdx;
+        binaryParse( ctx, &ctx->dom64, r );
+    }
+    else
+    {
+        if (ctx->dom64)
+        {
+            align_free(ctx->dom64);
+            ctx->dom64 = nullptr;
+        }
+
+        binaryParse( ctx, &ctx->dom, r );
+    }
+}
+
+
+extern "C" void turbojson_from_msgpack( struct JsonContext* ctx, const uint8_t* data, uint64_t len )
+{
+    binaryRead( ctx, data, len, TURBOJSON_FORMAT_MSGPACK );
+}
+
+
+extern "C" void turbojson_from_cbor( struct JsonContext* ctx, const uint8_t* data, uint64_t len )
+{
+    binaryRead( ctx, data, len, TURBOJSON_FORMAT_CBOR );
 }
 
 
-static uint32_t parseString( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz )
+/*
+Validation. UTF-8 and grammar are checked in one pass over 64 byte blocks. Each block is first
+reduced to bitmasks of its quotes, backslashes and control bytes, 32 bytes at a time with AVX2,
+which also runs the UTF-8 lookup algorithm of Keiser and Lemire ("Validating UTF-8 in less than
+one instruction per byte"), 8 bytes at a time otherwise. Escaped quotes and string contents are
+resolved from the masks with carries between blocks, as in simdjson, then spaces and structural
+characters are classified outside strings. The grammar state machine only runs on the structural
+characters and opening quotes outside strings and on the first byte of every number or literal.
+*/
+
+
+// Returns false with i on the lead byte of the first invalid UTF-8 sequence starting before end
+static bool validateUtf8Scalar( const uint8_t* buffer, uint64_t* indice, uint64_t end, uint64_t len )
 {
-    uint32_t i = *indice;
-    uint32_t j = *domIdx;
-    uint32_t dSz = *domSz;
-    uint32_t oIdx = j;
+    uint64_t i = *indice;
+
+    while (i < end)
+    {
+        uint64_t w;
+
+        while (i+8 <= end)
+        {
+            memcpy( &w, buffer+i, 8 );
+            if (w & 0x8080808080808080ULL) break;
+            i += 8;
+        }
+
+        if (i >= end) break;
 
-    assert( buffer[i] == '"' );
-    i++;
+        uint8_t c = buffer[i];
+        uint8_t lo = 0x80, hi = 0xBF;
+        uint32_t n;
 
-    j += 3;
-    dom[oIdx] = TURBOJSON_DOM_STRING;
-    dom[oIdx+1] = i; // The indice of the string
+        if (c < 0x80) { i++; continue; }
+        else if (c >= 0xC2 && c <= 0xDF) n = 1;
+        else if (c == 0xE0) { n = 2; lo = 0xA0; }
+        else if (c == 0xED) { n = 2; hi = 0x9F; }
+        else if (c >= 0xE1 && c <= 0xEF) n = 2;
+        else if (c == 0xF0) { n = 3; lo = 0x90; }
+        else if (c >= 0xF1 && c <= 0xF3) n = 3;
+        else if (c == 0xF4) { n = 3; hi = 0x8F; }
+        else break;
 
-    while ( (i < size) && buffer[i] != '"' ) i++;
+        if (i+n >= len) break;
+        if (buffer[i+1] < lo || buffer[i+1] > hi) break;
 
-    dom[oIdx+2] = i; // The indice of the end of the string
+        uint32_t k = 2;
+        while (k <= n && (buffer[i+k] & 0xC0) == 0x80) k++;
+        if (k <= n) break;
 
-    if (i < size) i++;
+        i += n+1;
+    }
 
     *indice = i;
-    *domIdx = j;
-    *domSz = dSz;
 
-    return oIdx;
+    return i >= end;
+}
+
+
+static const uint64_t turbojson_ones = 0x0101010101010101ULL;
+static const uint64_t turbojson_highs = 0x8080808080808080ULL;
+
+
+struct JsonValidateMasks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t space;
+    uint64_t structural;
+    uint64_t control;
+};
+
+
+#ifdef AVX2
+
+#define TURBOJSON_UTF8_TOO_SHORT 0x01
+#define TURBOJSON_UTF8_TOO_LONG 0x02
+#define TURBOJSON_UTF8_OVERLONG_3 0x04
+#define TURBOJSON_UTF8_TOO_LARGE 0x08
+#define TURBOJSON_UTF8_SURROGATE 0x10
+#define TURBOJSON_UTF8_OVERLONG_2 0x20
+#define TURBOJSON_UTF8_TOO_LARGE_1000 0x40
+#define TURBOJSON_UTF8_OVERLONG_4 0x40
+#define TURBOJSON_UTF8_TWO_CONTS 0x80
+#define TURBOJSON_UTF8_CARRY (TURBOJSON_UTF8_TOO_SHORT | TURBOJSON_UTF8_TOO_LONG | TURBOJSON_UTF8_TWO_CONTS)
+
+
+struct JsonUtf8Checker {
+    __m256i error;
+    __m256i prevInput;
+    __m256i prevIncomplete;
+};
+
+
+// The 32 bytes ending N bytes before the end of input, taken from prevInput then input
+template <int N>
+static inline __m256i utf8Prev( __m256i input, __m256i prevInput )
+{
+    return _mm256_alignr_epi8( input, _mm256_permute2x128_si256( prevInput, input, 0x21 ), 16 - N );
 }
 
 
-static uint32_t parseObjectMember( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz )
+static inline __m256i utf8HighNibble( __m256i v )
 {
-    uint32_t i = *indice;
-    uint32_t j = *domIdx;
-    uint32_t dSz = *domSz;
-    uint32_t oIdx = 0xFFFFFFFF;
+    return _mm256_and_si256( _mm256_srli_epi16( v, 4 ), _mm256_set1_epi8( 0x0F ) );
+}
 
-    assert( buffer[i] == '"' );
-    i++;
 
-    oIdx = j;
-    j += 5;
-    dom[oIdx] = TURBOJSON_DOM_MEMBER;
-    dom[oIdx+1] = i; // The indice of the id string
-    dom[oIdx+3] = 0xFFFFFFFF; // Child index
-    dom[oIdx+4] = 0xFFFFFFFF; // The next member
+static inline __m256i utf8Lookup( __m256i idx, char t0, char t1, char t2, char t3, char t4, char t5, char t6, char t7,
+    char t8, char t9, char t10, char t11, char t12, char t13, char t14, char t15 )
+{
+    return _mm256_shuffle_epi8( _mm256_setr_epi8( t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15,
+        t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15 ), idx );
+}
 
-    while ( (i < size) && buffer[i] != '"' ) i++;
 
-    if (i < size)
+static inline void utf8CheckBlock( JsonUtf8Checker& checker, __m256i input )
+{
+    if (_mm256_movemask_epi8( input ) == 0)
     {
-        dom[oIdx+2] = i++;
-        skipSpaces( buffer, &i, size );
-        assert( buffer[i] == ':' );
-        i++;
-        dom[oIdx+2] = parseChildElement( buffer, &i, size, dom, &j, &dSz );
+        checker.error = _mm256_or_si256( checker.error, checker.prevIncomplete );
+        checker.prevInput = input;
+        return;
     }
 
-    *indice = i;
-    *domIdx = j;
-    *domSz = dSz;
-
-    return oIdx;
+    __m256i prev1 = utf8Prev<1>( input, checker.prevInput );
+
+    __m256i byte1High = utf8Lookup( utf8HighNibble( prev1 ),
+        TURBOJSON_UTF8_TOO_LONG, TURBOJSON_UTF8_TOO_LONG, TURBOJSON_UTF8_TOO_LONG, TURBOJSON_UTF8_TOO_LONG,
+        TURBOJSON_UTF8_TOO_LONG, TURBOJSON_UTF8_TOO_LONG, TURBOJSON_UTF8_TOO_LONG, TURBOJSON_UTF8_TOO_LONG,
+        (char) TURBOJSON_UTF8_TWO_CONTS, (char) TURBOJSON_UTF8_TWO_CONTS, (char) TURBOJSON_UTF8_TWO_CONTS, (char) TURBOJSON_UTF8_TWO_CONTS,
+        TURBOJSON_UTF8_TOO_SHORT | TURBOJSON_UTF8_OVERLONG_2,
+        TURBOJSON_UTF8_TOO_SHORT,
+        TURBOJSON_UTF8_TOO_SHORT | TURBOJSON_UTF8_OVERLONG_3 | TURBOJSON_UTF8_SURROGATE,
+        TURBOJSON_UTF8_TOO_SHORT | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000 | TURBOJSON_UTF8_OVERLONG_4 );
+
+    __m256i byte1Low = utf8Lookup( _mm256_and_si256( prev1, _mm256_set1_epi8( 0x0F ) ),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_OVERLONG_3 | TURBOJSON_UTF8_OVERLONG_2 | TURBOJSON_UTF8_OVERLONG_4),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_OVERLONG_2),
+        (char) TURBOJSON_UTF8_CARRY,
+        (char) TURBOJSON_UTF8_CARRY,
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000 | TURBOJSON_UTF8_SURROGATE),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000),
+        (char) (TURBOJSON_UTF8_CARRY | TURBOJSON_UTF8_TOO_LARGE | TURBOJSON_UTF8_TOO_LARGE_1000) );
+
+    __m256i byte2High = utf8Lookup( utf8HighNibble( input ),
+        TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT,
+        TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT,
+        (char) (TURBOJSON_UTF8_TOO_LONG | TURBOJSON_UTF8_OVERLONG_2 | TURBOJSON_UTF8_TWO_CONTS | TURBOJSON_UTF8_OVERLONG_3 | TURBOJSON_UTF8_TOO_LARGE_1000 | TURBOJSON_UTF8_OVERLONG_4),
+        (char) (TURBOJSON_UTF8_TOO_LONG | TURBOJSON_UTF8_OVERLONG_2 | TURBOJSON_UTF8_TWO_CONTS | TURBOJSON_UTF8_OVERLONG_3 | TURBOJSON_UTF8_TOO_LARGE),
+        (char) (TURBOJSON_UTF8_TOO_LONG | TURBOJSON_UTF8_OVERLONG_2 | TURBOJSON_UTF8_TWO_CONTS | TURBOJSON_UTF8_SURROGATE | TURBOJSON_UTF8_TOO_LARGE),
+        (char) (TURBOJSON_UTF8_TOO_LONG | TURBOJSON_UTF8_OVERLONG_2 | TURBOJSON_UTF8_TWO_CONTS | TURBOJSON_UTF8_SURROGATE | TURBOJSON_UTF8_TOO_LARGE),
+        TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT, TURBOJSON_UTF8_TOO_SHORT );
+
+    __m256i special = _mm256_and_si256( _mm256_and_si256( byte1High, byte1Low ), byte2High );
+
+    // Third and fourth bytes of 3 and 4 byte sequences must be continuations, the lookups flagged them as TWO_CONTS
+    __m256i isThird = _mm256_subs_epu8( utf8Prev<2>( input, checker.prevInput ), _mm256_set1_epi8( 0xE0 - 0x80 ) );
+    __m256i isFourth = _mm256_subs_epu8( utf8Prev<3>( input, checker.prevInput ), _mm256_set1_epi8( 0xF0 - 0x80 ) );
+    __m256i must23 = _mm256_and_si256( _mm256_or_si256( isThird, isFourth ), _mm256_set1_epi8( (char) 0x80 ) );
+
+    checker.error = _mm256_or_si256( checker.error, _mm256_xor_si256( must23, special ) );
+
+    // A sequence starting in the last 3 bytes continues in the next block
+    checker.prevIncomplete = _mm256_subs_epu8( input, _mm256_setr_epi8( -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char) (0xF0-1), (char) (0xE0-1), (char) (0xC0-1) ) );
+    checker.prevInput = input;
 }
 
 
-static uint32_t parseObject( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz )
+// Rescans with the scalar checker from the sequence holding the byte 32 before the failing block
+static uint64_t validateUtf8Rescan( const uint8_t* buffer, uint64_t blockStart, uint64_t len )
 {
-    uint32_t i = *indice;
-    uint32_t j = *domIdx;
-    uint32_t dSz = *domSz;
-    uint32_t oIdx = 0xFFFFFFFF;
+    uint64_t i = blockStart >= 32 ? blockStart-32 : 0;
+    for (uint32_t k=0; k<3 && i > 0 && (buffer[i] & 0xC0) == 0x80; k++) i--;
+    validateUtf8Scalar( buffer, &i, len, len );
+    return i;
+}
 
-    assert( buffer[i] == '{' );
-    i++;
 
-    oIdx = j;
-    j += 2;
-    dom[oIdx] = TURBOJSON_DOM_OBJECT;
-    dom[oIdx+1] = 0xFFFFFFFF; // The list of members is a linked list whose last element points to -1
+static inline uint64_t validateMask( __m256i v )
+{
+    return (uint32_t) _mm256_movemask_epi8( v );
+}
 
-    uint32_t prevMemberIdx = 0xFFFFFFFF;
 
-    do {
-        skipSpaces( buffer, &i, size );
+// Fills the quote, backslash and control masks of the 64 bytes at p and feeds them to the UTF-8 checker
+static inline void validateStrings( const uint8_t* p, JsonValidateMasks& m, JsonUtf8Checker& checker )
+{
+    const __m256i control = _mm256_set1_epi8( 0x1F );
 
-        uint32_t memberIdx = parseObjectMember( buffer, &i, size, dom, &j, &dSz );
+    for (uint32_t k=0; k<64; k+=32)
+    {
+        __m256i v = _mm256_loadu_si256( (const __m256i*) (p+k) );
+
+        utf8CheckBlock( checker, v );
 
-        if (dom[oIdx+1] == 0xFFFFFFFF) dom[oIdx+1] = memberIdx;
-        else dom[prevMemberIdx+4] = memberIdx;
+        m.quote |= validateMask( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '"' ) ) ) << k;
+        m.backslash |= validateMask( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '\\' ) ) ) << k;
+        m.control |= validateMask( _mm256_cmpeq_epi8( _mm256_max_epu8( v, control ), control ) ) << k;
+    }
+}
 
-        prevMemberIdx = memberIdx;
 
-        skipSpaces( buffer, &i, size );
+// Fills the space and structural masks of the 64 bytes at p
+static inline void validateStructure( const uint8_t* p, JsonValidateMasks& m )
+{
+    // Indexed by the low nibble, a byte is a space or a structural character when it finds itself,
+    // once 0x20 is set for the structural one to turn '[' and ']' into '{' and '}'. 0x0C and 0x1A
+    // also pass as structural, no state accepts them so they fail where they stand.
+    const __m256i spaces = _mm256_setr_epi8( ' ', 100, 100, 100, 17, 100, 113, 2, 100, '\t', '\n', 112, 100, '\r', 100, 100,
+        ' ', 100, 100, 100, 17, 100, 113, 2, 100, '\t', '\n', 112, 100, '\r', 100, 100 );
+    const __m256i structurals = _mm256_setr_epi8( 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ':', '{', ',', '}', 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ':', '{', ',', '}', 0, 0 );
+
+    for (uint32_t k=0; k<64; k+=32)
+    {
+        __m256i v = _mm256_loadu_si256( (const __m256i*) (p+k) );
 
-        assert( buffer[i] == ',' || buffer[i] == '}' );
-        if (buffer[i] == ',') i++;
+        m.space |= validateMask( _mm256_cmpeq_epi8( v, _mm256_shuffle_epi8( spaces, v ) ) ) << k;
+        m.structural |= validateMask( _mm256_cmpeq_epi8( _mm256_or_si256( v, _mm256_set1_epi8( 0x20 ) ), _mm256_shuffle_epi8( structurals, v ) ) ) << k;
+    }
+}
 
-    } while ( (i < size) && buffer[i] != '}' );
+#else
 
-    if (i < size) i++;
-    //if (prevMemberIdx != 0xFFFFFFFF) dom[prevMemberIdx+4] = 0xFFFFFFFF;
+// Sets the high bit of the bytes of w equal to c
+static inline uint64_t swarEquals( uint64_t w, uint8_t c )
+{
+    uint64_t t = w ^ (turbojson_ones * c);
+    return ~(((t & ~turbojson_highs) + ~turbojson_highs) | t) & turbojson_highs;
+}
 
-    *indice = i;
-    *domIdx = j;
-    *domSz = dSz;
 
-    return oIdx;
+// Gathers the high bits of the 8 bytes of w in the low byte
+static inline uint64_t swarGather( uint64_t w )
+{
+    return ((w >> 7) * 0x0102040810204080ULL) >> 56;
 }
 
 
-static uint32_t parseArrayElement( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz )
+// Fills the quote, backslash and control masks of the 64 bytes at p, returns true if a byte is not ASCII
+static inline bool validateStrings( const uint8_t* p, JsonValidateMasks& m )
 {
-    uint32_t i = *indice;
-    uint32_t j = *domIdx;
-    uint32_t dSz = *domSz;
-    uint32_t oIdx = 0xFFFFFFFF;
+    uint64_t high = 0;
 
-    oIdx = j;
-    j += 3;
-    dom[oIdx] = TURBOJSON_DOM_ARRAY_ELEMENT;
-    dom[oIdx+1] = parseChildElement( buffer, &i, size, dom, &j, &dSz );
-    dom[oIdx+2] = 0xFFFFFFFF; // The next member
+    for (uint32_t k=0; k<64; k+=8)
+    {
+        uint64_t w;
+        memcpy( &w, p+k, 8 );
 
-    *indice = i;
-    *domIdx = j;
-    *domSz = dSz;
+        uint64_t quote = swarEquals( w, '"' );
+        uint64_t backslash = swarEquals( w, '\\' );
+        uint64_t control = ~(((w & ~turbojson_highs) + turbojson_ones*(0x80-0x20)) | w) & turbojson_highs;
 
-    return oIdx;
+        high |= w;
+
+        // Most words hold none of them
+        if ((quote | backslash | control) == 0) continue;
+
+        m.quote |= swarGather( quote ) << k;
+        m.backslash |= swarGather( backslash ) << k;
+        m.control |= swarGather( control ) << k;
+    }
+
+    return (high & turbojson_highs) != 0;
 }
 
 
-static uint32_t parseArray( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz )
-{
-    uint32_t i = *indice;
-    uint32_t j = *domIdx;
-    uint32_t dSz = *domSz;
-    uint32_t oIdx = 0xFFFFFFFF;
+// For each byte, one bit in the low byte if it is a space and in the high one if it is a structural character
+struct JsonValidateClasses {
+    uint16_t bits[256];
 
-    assert( buffer[i] == '[' );
-    i++;
+    JsonValidateClasses()
+    {
+        for (uint32_t c=0; c<256; c++)
+        {
+            bits[c] = 0;
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') bits[c] |= 0x0001;
+            if (c == ',' || c == ':' || c == '[' || c == ']' || c == '{' || c == '}') bits[c] |= 0x0100;
+        }
+    }
+};
 
-    oIdx = j;
-    j += 2;
-    dom[oIdx] = TURBOJSON_DOM_ARRAY;
-    dom[oIdx+1] = 0xFFFFFFFF; // The elements of the array are stored in a linked list
-    uint32_t prevElementIdx = 0xFFFFFFFF;
 
-    do {
-        uint32_t memberIdx = parseArrayElement( buffer, &i, size, dom, &j, &dSz );
+// Fills the space and structural masks of the 64 bytes at p, leaving out the words within strings
+static inline void validateStructure( const uint8_t* p, JsonValidateMasks& m, uint64_t strings )
+{
+    static const JsonValidateClasses classes;
 
-        if (dom[oIdx+1] == 0xFFFFFFFF) dom[oIdx+1] = memberIdx;
-        else dom[prevElementIdx+2] = memberIdx;
+    for (uint32_t k=0; k<64; k+=8)
+    {
+        if (((strings >> k) & 0xFF) == 0xFF) continue;
 
-        prevElementIdx = memberIdx;
+        // 8 bytes shifted by their rank fill both bytes of lanes
+        uint32_t lanes = 0;
+        for (uint32_t j=0; j<8; j++) lanes |= (uint32_t) classes.bits[p[k+j]] << j;
 
-        skipSpaces( buffer, &i, size );
+        m.space |= (uint64_t) (lanes & 0xFF) << k;
+        m.structural |= (uint64_t) ((lanes >> 8) & 0xFF) << k;
+    }
+}
 
-        assert( buffer[i] == ',' || buffer[i] == ']' );
-        if (buffer[i] == ',') i++;
+#endif
 
-    } while ( (i < size) && buffer[i] != ']' );
 
-    if (i < size) i++;
-    //if (prevElementIdx != 0xFFFFFFFF) dom[prevElementIdx+2] = 0xFFFFFFFF;
+// Flags the bytes following an odd run of backslashes, escaped carries the flag of the next block's first byte
+static inline uint64_t validateEscaped( uint64_t backslash, uint64_t* escaped )
+{
+    const uint64_t even = 0x5555555555555555ULL;
 
-    *indice = i;
-    *domIdx = j;
-    *domSz = dSz;
+    backslash &= ~*escaped;
+    uint64_t follows = (backslash << 1) | *escaped;
+    uint64_t oddStarts = backslash & ~even & ~follows;
+    uint64_t evenEnds = oddStarts + backslash;
 
-    return oIdx;
+    *escaped = evenEnds < oddStarts;
 
+    return (even ^ (evenEnds << 1)) & follows;
 }
 
 
-static uint32_t parseChildElement( uint8_t* buffer, uint32_t* indice, uint32_t size, uint32_t* dom, uint32_t* domIdx, uint32_t* domSz )
+// Sets every bit at or above each set bit an odd number of times
+static inline uint64_t prefixXor( uint64_t v )
 {
-    uint32_t i = *indice;
-    uint32_t j = *domIdx;
-    uint32_t dSz = *domSz;
-    uint32_t oIdx = 0xFFFFFFFF;
+    v ^= v << 1;
+    v ^= v << 2;
+    v ^= v << 4;
+    v ^= v << 8;
+    v ^= v << 16;
+    v ^= v << 32;
+    return v;
+}
+
 
-    skipSpaces( buffer, &i, size );
+// i is on the escaped byte of a string
+static inline bool validateEscape( const uint8_t* buffer, uint64_t i, uint64_t len )
+{
+    uint32_t cp;
 
     switch (buffer[i])
     {
-        case '"':
-            oIdx = parseString( buffer, &i, size, dom, &j, &dSz );
-            break;
-        case '{':
-            oIdx = parseObject( buffer, &i, size, dom, &j, &dSz );
-            break;
-        case '[':
-            oIdx = parseArray( buffer, &i, size, dom, &j, &dSz );
-            break;
-        default:
-            if ((buffer[i] >= '0' && buffer[i] <= '9') || (buffer[i] == '.') || (buffer[i] == '-'))
-                oIdx = parseDouble( buffer, &i, size, dom, &j, &dSz );
-            break;
+    case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+        return true;
+    case 'u':
+        return i+5 <= len && decodeHex4( buffer+i+1, &cp );
+    default:
+        return false;
+    }
+}
+
+
+static inline bool validateNumber( const uint8_t* buffer, uint64_t* indice, uint64_t len )
+{
+    uint64_t i = *indice;
+    bool ok = false;
+
+    if (i < len && buffer[i] == '-') i++;
+
+    if (i < len && buffer[i] == '0') i++;
+    else if (i < len && buffer[i] >= '1' && buffer[i] <= '9') while (i < len && buffer[i] >= '0' && buffer[i] <= '9') i++;
+    else goto done;
+
+    if (i < len && buffer[i] == '.')
+    {
+        i++;
+        if (i >= len || buffer[i] < '0' || buffer[i] > '9') goto done;
+        while (i < len && buffer[i] >= '0' && buffer[i] <= '9') i++;
     }
 
+    if (i < len && (buffer[i] == 'e' || buffer[i] == 'E'))
+    {
+        i++;
+        if (i < len && (buffer[i] == '+' || buffer[i] == '-')) i++;
+        if (i >= len || buffer[i] < '0' || buffer[i] > '9') goto done;
+        while (i < len && buffer[i] >= '0' && buffer[i] <= '9') i++;
+    }
+
+    ok = true;
+
+done:
     *indice = i;
-    *domIdx = j;
-    *domSz = dSz;
+    return ok;
+}
 
-    return oIdx;
+
+static inline bool validateLiteral( const uint8_t* buffer, uint64_t* indice, uint64_t len )
+{
+    uint64_t i = *indice;
+    const char* literal = buffer[i] == 't' ? "true" : (buffer[i] == 'f' ? "false" : "null");
+    uint64_t n = buffer[i] == 'f' ? 5 : 4;
+
+    if (i+n <= len && memcmp( buffer+i, literal, n ) == 0)
+    {
+        *indice = i+n;
+        return true;
+    }
+
+    // Finds the faulty byte
+    for (; *literal; literal++, i++) if (i >= len || buffer[i] != (uint8_t) *literal) break;
+
+    *indice = i;
+
+    return false;
 }
 
 
-extern "C" void turbojson_parsebuffer( struct JsonContext* ctx, uint8_t* jsonbuffer, uint32_t size, uint32_t allocsize )
+struct JsonValidateBlocks {
+    uint64_t base; // offset of the next block
+    uint64_t tokens; // structural positions of the current block
+    uint64_t tokenBase;
+    uint64_t scalars; // bytes of numbers and literals in the current block
+    uint64_t blockErr; // first string or UTF-8 error, len if there is none
+    uint64_t escaped; // carried from the previous block
+    uint64_t inString;
+    uint64_t inScalar;
+#ifdef AVX2
+    JsonUtf8Checker checker;
+#else
+    uint64_t utf8; // start of the next UTF-8 sequence to check
+#endif
+};
+
+
+// Reads blocks up to the next one holding structural positions, returns false at the end of the buffer or on an error
+static bool validateBlocks( const uint8_t* buffer, uint64_t len, JsonValidateBlocks& b )
 {
-    if (jsonbuffer != nullptr && size > 0 && allocsize > 0)
+    while (b.base < len && b.blockErr == len)
     {
-        ctx->jsonbuffer = jsonbuffer;
-        ctx->jsonbufferSize = size;
-        ctx->jsonbufferMax = allocsize;
+        uint64_t base = b.base;
+        const uint8_t* p = buffer+base;
+        uint8_t tail[64];
+        JsonValidateMasks m = JsonValidateMasks();
+
+        b.base += 64;
+
+        // The tail is padded with spaces, which also reports UTF-8 sequences cut by the end of the buffer
+        if (len-base < 64)
+        {
+            memset( tail, ' ', sizeof(tail) );
+            memcpy( tail, p, len-base );
+            p = tail;
+        }
 
-        if (ctx->dom == nullptr)
+#ifdef AVX2
+        validateStrings( p, m, b.checker );
+
+        if (!_mm256_testz_si256( b.checker.error, b.checker.error )) b.blockErr = validateUtf8Rescan( buffer, base, len );
+#else
+        if (!validateStrings( p, m )) b.utf8 = base+64;
+        else if (!validateUtf8Scalar( buffer, &b.utf8, base+64 < len ? base+64 : len, len )) b.blockErr = b.utf8;
+#endif
+
+        uint64_t escapes = validateEscaped( m.backslash, &b.escaped );
+        uint64_t quotes = m.quote & ~escapes;
+        uint64_t strings = prefixXor( quotes ) ^ b.inString; // opening quotes and string contents
+        b.inString = (uint64_t) ((int64_t) strings >> 63);
+
+        uint64_t controls = m.control & strings;
+        if (controls && base + count_trailing_zeros( controls ) < b.blockErr) b.blockErr = base + count_trailing_zeros( controls );
+
+        for (escapes &= strings; escapes; escapes &= escapes-1)
         {
-            ctx->dom = (uint32_t*) align_alloc( MAX_CACHE_LINE_SIZE, allocsize*sizeof(uint32_t) );
-            ctx->domSz = allocsize;
+            uint64_t e = base + count_trailing_zeros( escapes );
+            if (e >= b.blockErr) break;
+            if (!validateEscape( buffer, e, len )) b.blockErr = e;
         }
 
-        if (ctx->dom == nullptr) return;
+        // A block within a string, unless it opens it on its first byte, holds no structural position
+        if (strings == ~0ULL && !quotes)
+        {
+            b.inScalar = 0;
+            continue;
+        }
 
-        uint32_t i = 0;
-        uint32_t j = 0;
-        uint32_t dSz = ctx->domSz;
+#ifdef AVX2
+        validateStructure( p, m );
+#else
+        validateStructure( p, m, strings );
+#endif
 
-        skipSpaces( ctx->jsonbuffer, &i, ctx->jsonbufferSize );
+        uint64_t scalars = ~(m.space | m.structural | m.quote | strings);
+        b.tokens = (m.structural & ~strings) | (quotes & strings) | (scalars & ~((scalars << 1) | b.inScalar));
+        b.tokenBase = base;
+        b.scalars = scalars;
+        b.inScalar = scalars >> 63;
 
-        parseObject( ctx->jsonbuffer, &i, ctx->jsonbufferSize, ctx->dom, &j, &dSz );
+        // The grammar stops at the error of the block, a UTF-8 error may start in the block before
+        if (b.blockErr < len) b.tokens &= b.blockErr > base ? (1ULL << (b.blockErr - base)) - 1 : 0;
 
-        ctx->domIdx = j;
-        ctx->domSz = dSz;
+        if (b.tokens) return true;
     }
+
+    return false;
 }
 
 
-extern "C" void turbojson_stringify( struct JsonContext* ctx )
+// Bytes that continue a number or a literal, anything but a space, a structural character or a quote
+static inline bool validateScalarByte( uint8_t c )
 {
-    turbojson_pretty(ctx, false, 0, false);
+    switch (c)
+    {
+    case ' ': case '\t': case '\n': case '\r':
+    case ',': case ':': case '[': case ']': case '{': case '}': case '"':
+        return false;
+    default:
+        return true;
+    }
 }
 
 
-static void prettyRec( uint8_t* jsonout, uint32_t* dom, uint8_t* jsonbuffer, uint32_t &i, uint32_t &j, uint32_t ident, bool spaces, uint32_t numberSpaces, bool linereturn )
+// i is on the first byte of a number or a literal, returns false with errpos on the faulty byte
+static bool validateScalar( const uint8_t* buffer, uint64_t i, uint64_t len, const JsonValidateBlocks& b, uint64_t* errpos )
 {
-    uint32_t sz, ci;
+    uint8_t c = buffer[i];
+    uint64_t rest = ~b.scalars >> (i - b.tokenBase);
+    uint64_t end;
+    bool ok;
 
-    for (uint32_t k=0; k<ident*numberSpaces; k++) jsonbuffer[j++] = spaces ? ' ' : '\t';
+    // End of the run of scalar bytes, looked for byte by byte past the block
+    if (rest) end = i + count_trailing_zeros( rest );
+    else for (end = b.tokenBase+64; end < len && validateScalarByte( buffer[end] ); end++);
 
-    switch (dom[i])
+    if (c == '-' || (c >= '0' && c <= '9'))
     {
-    case TURBOJSON_DOM_STRING:
-        sz = dom[i+2]-dom[i+1]+2;
-        turbojson_memcpy(jsonout+j, jsonbuffer+dom[i+1]-1, jsonbuffer+dom[i+1]-1+sz);
-        j += sz;
-        i += 3;
-        break;
-    case TURBOJSON_DOM_REAL:
-        sz = dom[i+2]-dom[i+1];
-        turbojson_memcpy(jsonout+j, jsonbuffer+dom[i+1], jsonbuffer+dom[i+1]+sz);
-        j += sz;
-        i += 3;
-        break;
-    case TURBOJSON_DOM_OBJECT:
-        jsonout[j++] = '{';
-        if (linereturn) jsonbuffer[j++] = '\n';
-        i += 2;
-        prettyRec( jsonout, dom, jsonbuffer, i, j, ident+1, spaces, numberSpaces, linereturn );
-        jsonout[j++] = '}';
-        break;
-    case TURBOJSON_DOM_MEMBER:
-        sz = dom[i+2]-dom[i+1]+2;
-        turbojson_memcpy(jsonout+j, jsonbuffer+dom[i+1]-1, jsonbuffer+dom[i+1]-1+sz);
-        j += sz;
-        if (numberSpaces) jsonout[j++] = ' ';
-        jsonout[j++] = ':';
-        if (numberSpaces) jsonout[j++] = ' ';
-        ci = dom[i+3];
-        prettyRec( jsonout, dom, jsonbuffer, ci, j, ident+1, spaces, numberSpaces, linereturn );
-        if (dom[i+4] != 0xFFFFFFFF)
-        {
-            ci = dom[i+4];
-            jsonout[j++] = ',';
-            if (linereturn) jsonbuffer[j++] = '\n';
-            prettyRec( jsonout, dom, jsonbuffer, ci, j, ident, spaces, numberSpaces, linereturn );
-        }
-        else i = ci;
-        break;
-    case TURBOJSON_DOM_ARRAY:
-        jsonout[j++] = '[';
-        if (linereturn) jsonbuffer[j++] = '\n';
-        i += 2;
-        prettyRec( jsonout, dom, jsonbuffer, i, j, ident+1, spaces, numberSpaces, linereturn );
-        jsonout[j++] = ']';
-        break;
-    case TURBOJSON_DOM_ARRAY_ELEMENT:
-        ci = dom[i+1];
-        prettyRec( jsonout, dom, jsonbuffer, ci, j, ident+1, spaces, numberSpaces, linereturn );
-        if (dom[i+2] != 0xFFFFFFFF)
+        // Numbers of up to 7 bytes from a single load, the digit runs are counted on the bytes that are not digits
+        if (end-i < 8 && i+8 <= len)
         {
-            ci = dom[i+2];
-            jsonout[j++] = ',';
-            if (linereturn) jsonbuffer[j++] = '\n';
-            prettyRec( jsonout, dom, jsonbuffer, ci, j, ident, spaces, numberSpaces, linereturn );
+            uint64_t w;
+            memcpy( &w, buffer+i, 8 );
+            uint64_t t = w ^ (turbojson_ones*'0');
+            uint64_t other = ((((t & ~turbojson_highs) + turbojson_ones*(0x80-10)) | t) & turbojson_highs) | (0x80ULL << 8*(end-i));
+            uint64_t p = c == '-';
+            uint64_t n = count_trailing_zeros( other >> 8*p )/8;
+            bool fast = n > 0 && (n == 1 || buffer[i+p] != '0');
+
+            p += n;
+
+            if (fast && buffer[i+p] == '.')
+            {
+                n = count_trailing_zeros( other >> 8*(p+1) )/8;
+                fast = n > 0;
+                p += 1+n;
+            }
+
+            if (fast && i+p < end && (buffer[i+p] | 0x20) == 'e')
+            {
+                p++;
+                if (buffer[i+p] == '+' || buffer[i+p] == '-') p++;
+                n = count_trailing_zeros( other >> 8*p )/8;
+                fast = n > 0;
+                p += n;
+            }
+
+            if (fast && i+p == end) return true;
         }
-        else i = ci;
-        break;
-    default:
-        break;
+
+        ok = validateNumber( buffer, &i, end );
     }
+    else if (c == 't' || c == 'f' || c == 'n') ok = validateLiteral( buffer, &i, end );
+    else ok = false;
+
+    // The number or literal must take the whole run
+    if (ok && i == end) return true;
 
-    if (linereturn) jsonbuffer[j++] = '\n';
+    *errpos = i;
+
+    return false;
 }
 
 
-extern "C" void turbojson_pretty( struct JsonContext* ctx, bool spaces, uint32_t numberSpaces, bool linereturn )
+extern "C" bool turbojson_validate( const uint8_t* buffer, uint64_t len, uint64_t* errpos )
 {
-    size_t domsz = numberSpaces*ctx->domSz;
-    size_t reqoutsz = domsz > ctx->domSz*2 ? domsz : ctx->domSz*2;
-    if (reqoutsz < 65536) reqoutsz = 65536;
-
-    if (ctx->jsonout == nullptr || ctx->jsonoutMax<reqoutsz )
+    uint8_t local[256];
+    uint8_t* stack = local; // '{' or '[' for each open container
+    uint64_t stackSz = sizeof(local);
+    uint64_t depth = 0;
+    uint64_t i = len, err = len;
+    uint64_t tokens = 0, tokenBase = 0; // kept out of blocks to stay in registers
+    bool complete = false;
+    bool valid = false;
+    JsonValidateBlocks blocks;
+
+    blocks.base = 0;
+    blocks.tokens = 0;
+    blocks.tokenBase = 0;
+    blocks.scalars = 0;
+    blocks.blockErr = len;
+    blocks.escaped = 0;
+    blocks.inString = 0;
+    blocks.inScalar = 0;
+#ifdef AVX2
+    blocks.checker.error = _mm256_setzero_si256();
+    blocks.checker.prevInput = _mm256_setzero_si256();
+    blocks.checker.prevIncomplete = _mm256_setzero_si256();
+#else
+    blocks.utf8 = 0;
+#endif
+
+// Moves i to the next structural position, leaves for the end of the buffer or the error of the block
+#define TURBOJSON_VALIDATE_NEXT() \
+    do { \
+        if (tokens == 0) \
+        { \
+            if (!validateBlocks( buffer, len, blocks )) goto end; \
+            tokens = blocks.tokens; \
+            tokenBase = blocks.tokenBase; \
+        } \
+        i = tokenBase + count_trailing_zeros( tokens ); \
+        tokens &= tokens-1; \
+    } while (0)
+
+// i is on '{' or '['
+#define TURBOJSON_VALIDATE_PUSH() \
+    do { \
+        if (depth == stackSz) \
+        { \
+            uint8_t* grown = (uint8_t*) malloc( 2*stackSz ); \
+            if (grown == nullptr) goto done; \
+            memcpy( grown, stack, depth ); \
+            if (stack != local) free( stack ); \
+            stack = grown; \
+            stackSz *= 2; \
+        } \
+        stack[depth++] = buffer[i]; \
+    } while (0)
+
+    // Each state is a label so that every branch is predicted on its own, strings were checked with the block masks
+    TURBOJSON_VALIDATE_NEXT();
+    if (buffer[i] == '{') goto objectBegin;
+    if (buffer[i] == '[') goto arrayBegin;
+    if (buffer[i] != '"' && !validateScalar( buffer, i, len, blocks, &err )) goto scalarError;
+    goto documentEnd;
+
+objectBegin:
+    TURBOJSON_VALIDATE_PUSH();
+    TURBOJSON_VALIDATE_NEXT();
+    if (buffer[i] == '}') goto scopeEnd;
+
+objectKey:
+    if (buffer[i] != '"') goto done;
+    TURBOJSON_VALIDATE_NEXT();
+    if (buffer[i] != ':') goto done;
+    TURBOJSON_VALIDATE_NEXT();
+    if (buffer[i] == '{') goto objectBegin;
+    if (buffer[i] == '[') goto arrayBegin;
+    if (buffer[i] != '"' && !validateScalar( buffer, i, len, blocks, &err )) goto scalarError;
+
+objectContinue:
+    TURBOJSON_VALIDATE_NEXT();
+    if (buffer[i] == ',')
     {
-        if (ctx->jsonout) align_free(ctx->jsonout);
-
-        ctx->jsonout = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, reqoutsz );
-        ctx->jsonoutMax = reqoutsz;
+        TURBOJSON_VALIDATE_NEXT();
+        goto objectKey;
+    }
+    if (buffer[i] != '}') goto done;
+    goto scopeEnd;
+
+arrayBegin:
+    TURBOJSON_VALIDATE_PUSH();
+    TURBOJSON_VALIDATE_NEXT();
+    if (buffer[i] == ']') goto scopeEnd;
+
+arrayElement:
+    if (buffer[i] == '{') goto objectBegin;
+    if (buffer[i] == '[') goto arrayBegin;
+    if (buffer[i] != '"' && !validateScalar( buffer, i, len, blocks, &err )) goto scalarError;
+
+arrayContinue:
+    TURBOJSON_VALIDATE_NEXT();
+    if (buffer[i] == ',')
+    {
+        TURBOJSON_VALIDATE_NEXT();
+        goto arrayElement;
     }
+    if (buffer[i] != ']') goto done;
+
+scopeEnd:
+    depth--;
+    if (depth == 0) goto documentEnd;
+    if (stack[depth-1] == '{') goto objectContinue;
+    goto arrayContinue;
 
-    if (!ctx->jsonout) return;
+documentEnd:
+    // Anything after the root value is an error
+    complete = true;
+    TURBOJSON_VALIDATE_NEXT();
+    goto done;
 
-    uint32_t i=0, j=0;
+scalarError:
+    i = err;
+    goto done;
 
-    prettyRec( ctx->jsonout, ctx->dom, ctx->jsonbuffer, i, j, 0, spaces, numberSpaces, linereturn );
+end:
+    // A string left open is cut by the end of the buffer
+    i = blocks.blockErr;
+    valid = complete && blocks.blockErr == len && !blocks.inString;
 
-    ctx->jsonoutIdx = j;
+done:
+#undef TURBOJSON_VALIDATE_NEXT
+#undef TURBOJSON_VALIDATE_PUSH
+
+    if (stack != local) free( stack );
+
+    // A grammar error found past a string or UTF-8 error of its block comes second
+    if (blocks.blockErr < i) i = blocks.blockErr;
+    if (!valid && errpos) *errpos = i < len ? i : len;
+
+    return valid;
 }
 
 
@@ -515,4 +3845,3 @@ extern "C" void turbojson_writefile( struct JsonContext* ctx, const char* jsonfi
         fclose(out);
     }
 }
-
@@ -37,19 +37,137 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstdint>
 
 
+/*
+Context flags.
+
+TURBOJSON_LARGE_DOCUMENT selects the 64-bit tape (dom64) instead of the compact 32-bit
+one (dom). When the caller does not set it, each parse picks the tape on its own: the 64-bit
+one for inputs above compactMax bytes, TURBOJSON_COMPACT_MAX unless lowered by the caller.
+
+TURBOJSON_INTERN_KEYS deduplicates object keys into a per-context dictionary while parsing,
+members are then stored as TURBOJSON_DOM_MEMBER_KEY entries holding a key id.
+*/
+#define TURBOJSON_LARGE_DOCUMENT 1
+#define TURBOJSON_INTERN_KEYS 2
+
+// The largest input that can use the compact tape, which needs up to ~4 entries per input byte
+#define TURBOJSON_COMPACT_MAX 0x3FFFFFFF
+
+
+/*
+Tape entry types. Each entry is its type followed by:
+
+TURBOJSON_DOM_OBJECT          index of the first member, start and end offsets of the object in jsonbuffer
+TURBOJSON_DOM_STRING          start and end offsets of the string in jsonbuffer, quotes excluded
+TURBOJSON_DOM_REAL            start and end offsets of the number in jsonbuffer
+TURBOJSON_DOM_ARRAY           index of the first element, start and end offsets of the array in jsonbuffer
+TURBOJSON_DOM_MEMBER          start and end offsets of the key, index of the value, index of the next member
+TURBOJSON_DOM_ARRAY_ELEMENT   index of the value, index of the next element
+TURBOJSON_DOM_MEMBER_KEY      key id, index of the value, index of the next member
+TURBOJSON_DOM_LITERAL         start and end offsets of true, false or null in jsonbuffer
+
+The root value is at index 0. Lists end with an all ones index (0xFFFFFFFF on the compact tape).
+The top bit of the end offset of an object or an array is set when its source has no whitespace.
+*/
+#define TURBOJSON_DOM_OBJECT 1
+#define TURBOJSON_DOM_STRING 2
+#define TURBOJSON_DOM_REAL 3
+#define TURBOJSON_DOM_ARRAY 4
+#define TURBOJSON_DOM_MEMBER 5
+#define TURBOJSON_DOM_ARRAY_ELEMENT 6
+#define TURBOJSON_DOM_MEMBER_KEY 7
+#define TURBOJSON_DOM_LITERAL 8
+
+
+// Returned by the lookup functions when there is no such member or key
+#define TURBOJSON_NOT_FOUND 0xFFFFFFFFFFFFFFFFULL
+
+
 struct JsonContext {
     uint8_t *jsonbuffer;
-    uint32_t jsonbufferSize;
-    uint32_t jsonbufferMax;
+    uint64_t jsonbufferSize;
+    uint64_t jsonbufferMax;
     uint32_t *dom;
-    uint32_t domIdx;
-    uint32_t domSz;
+    uint64_t *dom64;
+    uint64_t domIdx;
+    uint64_t domSz;
     uint32_t *values;
     uint32_t valuesIdx;
     uint32_t valuesSz;
     uint8_t *jsonout;
-    uint32_t jsonoutIdx;
-    uint32_t jsonoutMax;
+    uint64_t jsonoutIdx;
+    uint64_t jsonoutMax;
+    uint64_t *keys;
+    uint32_t keysIdx;
+    uint32_t keysSz;
+    uint64_t *keysTable;
+    uint32_t keysTableSz;
+    uint32_t flags;
+    uint64_t compactMax;
+};
+
+
+/*
+A typed column filled by turbojson_to_columns from the members named name of an array of
+objects. The caller sets name, nameLen and type, the buffers are allocated by
+turbojson_to_columns and released by turbojson_freeColumns.
+
+As in Arrow, validity holds one bit per row, least significant bit first, set when the row
+has a value of the column type, and the values of null rows are 0. TURBOJSON_COLUMN_INT64 and
+TURBOJSON_COLUMN_DOUBLE fill values with int64_t and double values, TURBOJSON_COLUMN_STRING
+fills stringOffsets and stringLengths with the location of the strings in jsonbuffer, quotes
+excluded and escapes left as is.
+*/
+#define TURBOJSON_COLUMN_INT64 1
+#define TURBOJSON_COLUMN_DOUBLE 2
+#define TURBOJSON_COLUMN_STRING 3
+
+
+struct JsonColumn {
+    const char *name;
+    uint64_t nameLen;
+    uint32_t type;
+    uint64_t length;
+    uint64_t nullCount;
+    uint8_t *validity;
+    void *values;
+    uint64_t *stringOffsets;
+    uint32_t *stringLengths;
+};
+
+
+/*
+A frozen, reference counted and read-only document. turbojson_freeze takes over a parsed
+context, which must not be used directly afterwards. Any number of threads may then query the
+context returned by turbojson_documentContext at the same time through the functions taking a
+const context. The document is freed when its last reference is released.
+
+A slot holds the current version of a document. turbojson_acquire returns it with a new
+reference that the reader releases when done, turbojson_publish swaps in another version and
+gives up the reference of the slot on the previous one. Neither takes a lock, past 65535
+threads inside turbojson_acquire at the same time the others wait for one of them to return.
+Both turbojson_allocateSlot and turbojson_publish take over the reference of the caller on doc.
+turbojson_freeze returns nullptr if the document cannot be allocated below 2^48.
+*/
+struct JsonDocument;
+struct JsonDocumentSlot;
+
+
+/*
+Callbacks of turbojson_parse_events, called in document order with the userdata pointer. The
+text passed to key and string excludes the quotes and leaves escapes as is, number and literal
+receive the source text of the value. Callbacks left null are skipped. From C++, the template
+turbojson_parse_events of turbojson_events.h takes a handler object whose calls can be inlined.
+*/
+struct JsonEventHandlers {
+    void (*startObject)( void* userdata );
+    void (*endObject)( void* userdata );
+    void (*startArray)( void* userdata );
+    void (*endArray)( void* userdata );
+    void (*key)( void* userdata, const uint8_t* start, uint64_t len );
+    void (*string)( void* userdata, const uint8_t* start, uint64_t len );
+    void (*number)( void* userdata, const uint8_t* start, uint64_t len );
+    void (*literal)( void* userdata, const uint8_t* start, uint64_t len );
 };
 
 
@@ -57,15 +175,50 @@ struct JsonContext {
 extern "C" {
 #endif
 
-    struct JsonContext* turbojson_allocateContext();
+    struct JsonContext* turbojson_allocateContext( uint32_t flags=0 );
     void turbojson_freeContext( struct JsonContext* ctx );
 
+    struct JsonDocument* turbojson_freeze( struct JsonContext* ctx );
+    const struct JsonContext* turbojson_documentContext( const struct JsonDocument* doc );
+    void turbojson_retain( struct JsonDocument* doc );
+    void turbojson_release( struct JsonDocument* doc );
+
+    struct JsonDocumentSlot* turbojson_allocateSlot( struct JsonDocument* doc );
+    void turbojson_freeSlot( struct JsonDocumentSlot* slot );
+    struct JsonDocument* turbojson_acquire( struct JsonDocumentSlot* slot );
+    void turbojson_publish( struct JsonDocumentSlot* slot, struct JsonDocument* doc );
+
     void turbojson_parsefile( struct JsonContext* ctx, const char* jsonfilename );
-    void turbojson_parsebuffer( struct JsonContext* ctx, uint8_t* jsonbuffer, uint32_t size, uint32_t allocsize );
+    void turbojson_parsebuffer( struct JsonContext* ctx, uint8_t* jsonbuffer, uint64_t size, uint64_t allocsize );
+    void turbojson_parse_events( const uint8_t* buffer, uint64_t len, const struct JsonEventHandlers* handlers, void* userdata );
+
+    uint64_t turbojson_getMember( const struct JsonContext* ctx, uint64_t objIdx, const char* key, uint64_t len );
+    uint64_t turbojson_keyId( const struct JsonContext* ctx, const char* key, uint64_t len );
+    uint64_t turbojson_getMemberById( const struct JsonContext* ctx, uint64_t objIdx, uint64_t keyId );
+
+    bool turbojson_to_columns( const struct JsonContext* ctx, uint64_t arrayIdx, struct JsonColumn* columns, uint32_t ncolumns );
+    void turbojson_freeColumns( struct JsonColumn* columns, uint32_t ncolumns );
 
     void turbojson_stringify( struct JsonContext* ctx );
     void turbojson_pretty( struct JsonContext* ctx, bool spaces, uint32_t numberSpaces, bool linereturn=true );
 
+    // Same output as turbojson_stringify and turbojson_pretty, the children of the root are written by nthreads threads (0 for one per core)
+    void turbojson_stringify_parallel( struct JsonContext* ctx, uint32_t nthreads=0 );
+    void turbojson_pretty_parallel( struct JsonContext* ctx, bool spaces, uint32_t numberSpaces, bool linereturn=true, uint32_t nthreads=0 );
+
+    void turbojson_canonical( struct JsonContext* ctx );
+
+    // MessagePack and CBOR encodings of the document in jsonout, and their parsers filling the tape and a JSON jsonbuffer
+    void turbojson_to_msgpack( struct JsonContext* ctx );
+    void turbojson_to_cbor( struct JsonContext* ctx );
+    void turbojson_from_msgpack( struct JsonContext* ctx, const uint8_t* data, uint64_t len );
+    void turbojson_from_cbor( struct JsonContext* ctx, const uint8_t* data, uint64_t len );
+
+    uint64_t turbojson_hash( const struct JsonContext* ctx, uint64_t idx );
+    void turbojson_hash128( const struct JsonContext* ctx, uint64_t idx, uint64_t hash[2] );
+
+    bool turbojson_validate( const uint8_t* buffer, uint64_t len, uint64_t* errpos );
+
     void turbojson_writefile( struct JsonContext* ctx, const char* jsonfilename );
 
 #if defined (__cplusplus)
@@ -0,0 +1,372 @@
+#pragma once
+/*
+TurboJson parser grammar and event parser.
+
+BSD 3-Clause License
+
+Copyright (c) 2024, Julien Perrier-cornet
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <cstdint>
+#include <cassert>
+
+
+#include "turbojson.h"
+
+
+// The "no element" marker of the linked lists of the tape, 0xFFFFFFFF on the compact tape
+#define TURBOJSON_NIL( T ) ((T) ~((T) 0))
+
+
+/*
+Scanning helpers.
+*/
+
+template <typename T>
+static inline void turbojson_skipSpaces( const uint8_t* buffer, T *indice, T size )
+{
+    T i = *indice;
+    while ((i < size) && (buffer[i] == ' ' || buffer[i] == '\t' || buffer[i] == '\n' || buffer[i] == '\r')) i++;
+    *indice = i;
+}
+
+
+static inline bool turbojson_isNumberChar( uint8_t c )
+{
+    return (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E';
+}
+
+
+// Moves i to the closing quote of the string, skipping escaped characters
+template <typename T>
+static inline void turbojson_skipString( const uint8_t* buffer, T *indice, T size )
+{
+    T i = *indice;
+    while ( (i < size) && buffer[i] != '"' )
+    {
+        if (buffer[i] == '\\' && i+1 < size) i++;
+        i++;
+    }
+    *indice = i;
+}
+
+
+/*
+Grammar. The parse functions scan the input and report what they find to a sink, the tape of
+turbojson_parsebuffer (JsonTape in turbojson.cpp) or the handler of turbojson_parse_events.
+Index is the type of tape indices and buffer offsets, a sink provides:
+
+bool reserve( Index n )                               room for n more entries, false stops the parse
+void skipped( Index n )                               n whitespace bytes were skipped
+Index spacesSkipped()                                 whitespace bytes skipped so far
+Index scalar( buffer, type, start, end )              a string, number or literal
+Index beginContainer( type, start )                   an object or an array opens at start
+void endContainer( container, type, end, minified )   and closes at end
+Index member( buffer, keyStart, keyEnd )              a member key, nil stops the parse
+void memberValue( member, value )
+Index element()                                       an array element
+void elementValue( element, value )
+void link( container, prev, item, type )              item follows prev in the container
+*/
+
+template <typename Sink>
+static inline void turbojson_skipSpaces( const uint8_t* buffer, typename Sink::Index *indice, typename Sink::Index size, Sink& sink )
+{
+    typename Sink::Index i = *indice;
+    turbojson_skipSpaces( buffer, indice, size );
+    sink.skipped( *indice - i );
+}
+
+
+template <typename Sink>
+static typename Sink::Index turbojson_parseChildElement( const uint8_t* buffer, typename Sink::Index* indice, typename Sink::Index size, Sink& sink );
+
+
+template <typename Sink>
+static typename Sink::Index turbojson_parseScalar( const uint8_t* buffer, typename Sink::Index* indice, typename Sink::Index size, Sink& sink, uint32_t type )
+{
+    typedef typename Sink::Index T;
+    T i = *indice;
+
+    if (!sink.reserve( (T) 3 ))
+    {
+        *indice = size;
+        return TURBOJSON_NIL(T);
+    }
+
+    T start = i;
+
+    if (type == TURBOJSON_DOM_STRING)
+    {
+        assert( buffer[i] == '"' );
+        start = ++i;
+        turbojson_skipString( buffer, &i, size );
+    }
+    else if (type == TURBOJSON_DOM_LITERAL) while ((i < size) && buffer[i] >= 'a' && buffer[i] <= 'z') i++;
+    else while ((i < size) && turbojson_isNumberChar( buffer[i] )) i++;
+
+    T oIdx = sink.scalar( buffer, type, start, i );
+
+    if (type == TURBOJSON_DOM_STRING && i < size) i++;
+
+    *indice = i;
+
+    return oIdx;
+}
+
+
+template <typename Sink>
+static typename Sink::Index turbojson_parseObjectMember( const uint8_t* buffer, typename Sink::Index* indice, typename Sink::Index size, Sink& sink )
+{
+    typedef typename Sink::Index T;
+    T i = *indice;
+
+    if (!sink.reserve( (T) 5 ))
+    {
+        *indice = size;
+        return TURBOJSON_NIL(T);
+    }
+
+    assert( buffer[i] == '"' );
+    i++;
+
+    T keyStart = i;
+
+    turbojson_skipString( buffer, &i, size );
+
+    T oIdx = sink.member( buffer, keyStart, i );
+
+    if (oIdx == TURBOJSON_NIL(T))
+    {
+        *indice = size;
+        return oIdx;
+    }
+
+    if (i < size)
+    {
+        i++;
+        turbojson_skipSpaces( buffer, &i, size, sink );
+        assert( i >= size || buffer[i] == ':' );
+        if (i < size) i++;
+        T childIdx = turbojson_parseChildElement( buffer, &i, size, sink );
+        sink.memberValue( oIdx, childIdx );
+    }
+
+    *indice = i;
+
+    return oIdx;
+}
+
+
+template <typename Sink>
+static typename Sink::Index turbojson_parseArrayElement( const uint8_t* buffer, typename Sink::Index* indice, typename Sink::Index size, Sink& sink )
+{
+    typedef typename Sink::Index T;
+    T i = *indice;
+
+    if (!sink.reserve( (T) 3 ))
+    {
+        *indice = size;
+        return TURBOJSON_NIL(T);
+    }
+
+    T oIdx = sink.element();
+    T childIdx = turbojson_parseChildElement( buffer, &i, size, sink );
+    sink.elementValue( oIdx, childIdx );
+
+    *indice = i;
+
+    return oIdx;
+}
+
+
+// Objects and arrays, type is TURBOJSON_DOM_OBJECT or TURBOJSON_DOM_ARRAY
+template <typename Sink>
+static typename Sink::Index turbojson_parseContainer( const uint8_t* buffer, typename Sink::Index* indice, typename Sink::Index size, Sink& sink, uint32_t type )
+{
+    typedef typename Sink::Index T;
+    T i = *indice;
+    uint8_t close = type == TURBOJSON_DOM_OBJECT ? '}' : ']';
+
+    if (!sink.reserve( (T) 4 ))
+    {
+        *indice = size;
+        return TURBOJSON_NIL(T);
+    }
+
+    T spaces = sink.spacesSkipped();
+
+    assert( buffer[i] == (type == TURBOJSON_DOM_OBJECT ? '{' : '[') );
+    i++;
+
+    // The members or elements are stored in a linked list whose last element points to -1
+    T oIdx = sink.beginContainer( type, i-1 );
+    T prevIdx = TURBOJSON_NIL(T);
+
+    turbojson_skipSpaces( buffer, &i, size, sink );
+
+    while ( (i < size) && buffer[i] != close )
+    {
+        T start = i;
+        T itemIdx = type == TURBOJSON_DOM_OBJECT ? turbojson_parseObjectMember( buffer, &i, size, sink ) : turbojson_parseArrayElement( buffer, &i, size, sink );
+
+        sink.link( oIdx, prevIdx, itemIdx, type );
+
+        if (itemIdx != TURBOJSON_NIL(T)) prevIdx = itemIdx;
+
+        turbojson_skipSpaces( buffer, &i, size, sink );
+
+        assert( i >= size || buffer[i] == ',' || buffer[i] == close );
+        if (i < size && buffer[i] == ',') i++;
+
+        turbojson_skipSpaces( buffer, &i, size, sink );
+
+        if (i == start) break; // Unknown value
+    }
+
+    if (i < size)
+    {
+        i++;
+        sink.endContainer( oIdx, type, i, sink.spacesSkipped() == spaces );
+    }
+    else sink.endContainer( oIdx, type, i, false );
+
+    *indice = i;
+
+    return oIdx;
+}
+
+
+template <typename Sink>
+static typename Sink::Index turbojson_parseChildElement( const uint8_t* buffer, typename Sink::Index* indice, typename Sink::Index size, Sink& sink )
+{
+    typedef typename Sink::Index T;
+    T i = *indice;
+    T oIdx = TURBOJSON_NIL(T);
+
+    turbojson_skipSpaces( buffer, &i, size, sink );
+
+    if (i >= size)
+    {
+        *indice = i;
+        return oIdx;
+    }
+
+    switch (buffer[i])
+    {
+        case '"':
+            oIdx = turbojson_parseScalar( buffer, &i, size, sink, TURBOJSON_DOM_STRING );
+            break;
+        case '{':
+            oIdx = turbojson_parseContainer( buffer, &i, size, sink, TURBOJSON_DOM_OBJECT );
+            break;
+        case '[':
+            oIdx = turbojson_parseContainer( buffer, &i, size, sink, TURBOJSON_DOM_ARRAY );
+            break;
+        case 't':
+        case 'f':
+        case 'n':
+            oIdx = turbojson_parseScalar( buffer, &i, size, sink, TURBOJSON_DOM_LITERAL );
+            break;
+        default:
+            if ((buffer[i] >= '0' && buffer[i] <= '9') || (buffer[i] == '.') || (buffer[i] == '-'))
+                oIdx = turbojson_parseScalar( buffer, &i, size, sink, TURBOJSON_DOM_REAL );
+            break;
+    }
+
+    *indice = i;
+
+    return oIdx;
+}
+
+
+/*
+Event parser. turbojson_parse_events runs the grammar above with a sink that calls the handler
+instead of building a tape. Handler must provide:
+
+void startObject(), void endObject(), void startArray(), void endArray()
+void key( const uint8_t* start, uint64_t len )       the key, quotes excluded and escapes left as is
+void string( const uint8_t* start, uint64_t len )    the string, quotes excluded and escapes left as is
+void number( const uint8_t* start, uint64_t len )    the source text of the number
+void literal( const uint8_t* start, uint64_t len )   true, false or null
+
+The calls are resolved at compile time so that the handler can be inlined.
+*/
+
+template <typename Handler>
+struct JsonEventSink {
+    typedef uint64_t Index;
+
+    Handler& handler;
+
+    bool reserve( uint64_t ) { return true; }
+    void skipped( uint64_t ) {}
+    uint64_t spacesSkipped() { return 0; }
+
+    uint64_t scalar( const uint8_t* buffer, uint32_t type, uint64_t start, uint64_t end )
+    {
+        if (type == TURBOJSON_DOM_STRING) handler.string( buffer+start, end-start );
+        else if (type == TURBOJSON_DOM_LITERAL) handler.literal( buffer+start, end-start );
+        else handler.number( buffer+start, end-start );
+        return 0;
+    }
+
+    uint64_t beginContainer( uint32_t type, uint64_t )
+    {
+        if (type == TURBOJSON_DOM_OBJECT) handler.startObject();
+        else handler.startArray();
+        return 0;
+    }
+
+    void endContainer( uint64_t, uint32_t type, uint64_t, bool )
+    {
+        if (type == TURBOJSON_DOM_OBJECT) handler.endObject();
+        else handler.endArray();
+    }
+
+    uint64_t member( const uint8_t* buffer, uint64_t keyStart, uint64_t keyEnd )
+    {
+        handler.key( buffer+keyStart, keyEnd-keyStart );
+        return 0;
+    }
+
+    void memberValue( uint64_t, uint64_t ) {}
+    uint64_t element() { return 0; }
+    void elementValue( uint64_t, uint64_t ) {}
+    void link( uint64_t, uint64_t, uint64_t, uint32_t ) {}
+};
+
+
+template <typename Handler>
+static inline void turbojson_parse_events( const uint8_t* buffer, uint64_t len, Handler& handler )
+{
+    JsonEventSink<Handler> sink = { handler };
+    uint64_t i = 0;
+    turbojson_parseChildElement( buffer, &i, len, sink );
+}